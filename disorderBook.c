@@ -8,26 +8,73 @@
     PROTOCOL:
 
     We don't handle user input directly. The frontend is responsible for
-    sending us commands as single lines. Only the ORDER command is tricky:
+    sending us commands as single lines.
 
-    ORDER  <account>  <account_id>  <(int32) qty>  <(int32) price>  <dir:1|2>  <orderType:1|2|3|4>
+    One backend process can host many books. Every command starts with the
+    number of the book it is for (the frontend chooses these; keep them low
+    since an array of books is indexed by them). A book is created with:
+
+    <book>  INIT  <venue>  <symbol>
+
+    If a venue and symbol are given on the command line, book 0 is created
+    from them at startup. Otherwise we start with no books, as a spare
+    backend (pre-started by the frontend so that books can be created quickly).
+
+    Only the ORDER command is tricky:
+
+    <book>  ORDER  <account>  <account_id>  <(int32) qty>  <(int32) price>  <dir:1|2>  <orderType:1|2|3|4>
 
     e.g.
 
-    ORDER  CES134127       5             100             5000           1               3
+    0       ORDER  CES134127       5             100             5000           1               3
 
     The frontend must give each account a unique, low, non-negative integer as
     an id (RAM is allocated based on these, so keep them as low as possible).
 
     Numbers for direction and orderType are defined below.
 
-    Other commands:
+    Other commands (each preceded by the book number, as above):
 
     QUOTE
-    ORDERBOOK
-    CANCEL <id>
-    STATUS <id>
-    STATUSALL <account_id>
+    ORDERBOOK_BINARY [depth=<n>] [orders=<n>]
+    LEVELS_BINARY [depth=<n>]
+    CANCEL <id> [<account> ...]
+    STATUS <id> [<option> ...] [<account> ...]
+    STATUSALL <account_id> [<option> ...]
+    SUBSCRIBE TICKER <0|1>
+    SUBSCRIBE EXECUTIONS <account_id> <0|1>
+    SUBSCRIBE DEPTH <0|1>
+    SUBSCRIBE BOOK <0|1>
+
+    If CANCEL or STATUS are followed by one or more account names, the order
+    must belong to one of them or we refuse (with the same error the frontend
+    uses for authentication failures). This lets the frontend do the auth
+    check and the actual request in a single trip.
+
+    STATUS and STATUSALL can be limited to part of their output with options
+    of the form name=value (which can't be confused with account names, as
+    those never contain '='):
+
+    fills_offset=<n>    skip the first n fills of each order
+    fills_limit=<n>     print at most n fills of each order
+    after=<id>          STATUSALL only: start after this order id (a cursor)
+    offset=<n>          STATUSALL only: skip the first n orders
+    limit=<n>           STATUSALL only: print at most n orders, and say whether there are "more"
+
+    ORDERBOOK_BINARY can be limited to the best n levels of each side with
+    depth=<n>, or to the best n orders of each side with orders=<n> (or both).
+    Either way we stop there, so the rest of the book isn't even looked at.
+
+    LEVELS_BINARY is like ORDERBOOK_BINARY, but with one record per price level
+    (see print_levels_binary() for the format). It can be limited with depth=<n>
+    in the same way.
+
+    SUBSCRIBE tells us whether anyone is listening to this book's ticker, or
+    to the executions of one account, or to changes in its price levels, or
+    to changes in its individual resting orders. We only send the events (see
+    below) that someone is listening to, and to begin with, nobody is.
+    SUBSCRIBE DEPTH 1 and SUBSCRIBE BOOK 1 always send the whole book, even if
+    it was already subscribed to, so the frontend can use them to resync.
 
     __SCORES__
     __DEBUG_MEMORY__
@@ -37,10 +84,109 @@
     frontend for authentication purposes (i.e. is the user entitled to cancel
     this order?)
 
+    Every reply is sent as a header line followed by exactly <length> bytes:
+
+    REPLY <book> <length> <version>
+
+    The frontend can thus tell which book a reply belongs to. The version is a
+    count of the changes to the book's orderbook and quote so far (it is 0 if
+    there is no such book). Two replies with the same version were made from
+    the same orderbook, so it can be used to tell if anything has changed.
+
+
+    EVENTS:
+
+    We don't write WebSocket messages ourselves. Instead, on the other channel
+    (stderr) we send a compact binary stream of events, from which the frontend
+    renders the Stockfighter JSON -- but only for the subscribers it actually
+    has. The stream starts with the 4 bytes "DBEV" and a 4-byte version number
+    (EVENT_VERSION), then has any number of records. All integers are big-endian,
+    like the binary orderbook. Each record is:
+
+    4 bytes     length of the rest of the record
+    1 byte      type
+    4 bytes     book number
+    8 bytes     sequence number (per book, starting at 1)
+    ...         the fields for that type, as follows
+
+    EVENT_ORDER     id(4) direction(1) orderType(1) qty(4) price(4) account(s) ts(s)
+    EVENT_TRADE     standing id(4) incoming id(4) price(4) qty(4) ts(s)
+                    standing complete(1) incoming complete(1)
+    EVENT_CLOSED    id(4)       -- an order that never rested (market, IOC, FOK) is done
+    EVENT_CANCEL    id(4)       -- a resting order was cancelled
+    EVENT_QUOTE     bid(4) ask(4) bidSize(8) askSize(8) bidDepth(8) askDepth(8)
+                    last(4) lastSize(4) lastTrade(s) quoteTime(s) version(8)
+    EVENT_OLD_FILL  id(4) price(4) qty(4) ts(s)
+    EVENT_LEVEL     version(8) direction(1) price(4) qty(8) orders(4) more(1)
+    EVENT_BOOK_RESET    version(8) more(1)
+    EVENT_RESTING   version(8) id(4) direction(1) price(4) qty(4) filled(4) more(1)
+    EVENT_RESTING_RESET version(8) more(1)
+
+    where (s) is a 1-byte length followed by that many bytes. An order fully
+    filled by a trade is also done; there is no separate event for that. A
+    quote's version is the book's (as in the REPLY header) once it is made. The
+    frontend should skip records of any type it doesn't know, using the length.
+
+    Order events are only sent for accounts whose executions are subscribed
+    to, and trades only if either side's account is. When a subscription
+    starts, each of the account's open orders is sent (EVENT_ORDER, with its
+    original qty) followed by the fills it already had (EVENT_OLD_FILL). When
+    one stops, each is sent as EVENT_CLOSED, so the frontend can forget it.
+    Quotes are only sent while the ticker is subscribed to.
+
+    EVENT_LEVEL gives the new totals of a price level (qty 0 if it's gone).
+    While depth is subscribed to, every change to the book's version is
+    followed by an EVENT_LEVEL for each level it touched, all with the new
+    version and all but the last with more set. EVENT_BOOK_RESET says to
+    forget every level; it is followed (if more is set) by an EVENT_LEVEL for
+    each level the book has, at the same version. So the frontend can keep
+    its own copy of the levels, and knows it has missed something if a new
+    version isn't the old one plus 1.
+
+    EVENT_RESTING and EVENT_RESTING_RESET do the same for individual resting
+    orders, while the book is subscribed to: qty is what is left on the book
+    (0 if the order is gone) and filled is its total filled so far, so a fill
+    can be told from a cancel. Orders at the same price have priority in
+    order of id.
+
+
+    TRANSPORT:
+
+    Normally commands arrive on stdin, replies go to stdout and events
+    go to stderr. On Linux, if started with the extra argument -shm,
+    we instead expect fd 3 to be a shared memory file set up by the frontend
+    holding 3 single-producer / single-consumer byte rings (commands, replies,
+    events) and we point stdin/stdout/stderr at those. The bytes
+    that travel are exactly the same either way.
+
+
+    THREADS:
+
+    With the argument -threads <n> we run n matching threads, each of which
+    owns the books whose number is congruent to it modulo n. The main thread
+    only reads commands and passes each to the owning thread through a
+    lock-free single-producer / single-consumer queue; nothing on the matching
+    path takes a lock, and only the final write of each reply or batch of
+    events is serialised. With -affinity <cpus> (e.g. 0,2,4-7) the threads
+    are pinned to those CPUs in turn (Linux only). On Windows we always use
+    a single thread.
+
+    Events are not written by the matching threads at all. They push them
+    (as fixed-size structs) onto a queue of their own, and a separate emitter
+    thread turns these into the binary records above and writes them to
+    stderr in large batches.
+
     */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE         // For fopencookie()
+#endif
+
+#include "disorderBook.h"
+
 #include <assert.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,6 +198,27 @@
     #include <fcntl.h>
 #endif
 
+// The shared memory transport uses futexes, so is Linux only
+#if defined(__linux__)
+    #include <linux/futex.h>
+    #include <sys/mman.h>
+    #include <sys/prctl.h>
+    #include <sys/stat.h>
+    #include <sys/syscall.h>
+    #include <signal.h>
+    #include <unistd.h>
+#endif
+
+// Matching threads use pthreads, so aren't available on Windows (where the main thread does everything)
+#if !defined(_WIN32)
+    #define USE_THREADS
+    #include <pthread.h>
+    #include <sched.h>
+    #define STRTOK(str, delim, saveptr) strtok_r(str, delim, saveptr)
+#else
+    #define STRTOK(str, delim, saveptr) strtok(str, delim)
+#endif
+
 #define BUY 1       // Don't change these now, they are also used in the frontend
 #define SELL 2
 
@@ -64,6 +231,26 @@
 #define SMALLSTRING 64
 #define MAXTOKENS 64                // Well-behaved frontend will never send this many
 
+#define QUEUE_SLOTS 1024            // Per matching thread, must be a power of 2
+#define QUEUE_SPIN 4000
+
+#define EVENT_QUEUE_SLOTS 4096      // Per matching thread, must be a power of 2
+#define EMITTER_BATCH 65536         // Bytes the emitter builds up before writing
+
+#define EVENT_VERSION 5             // Change this whenever the event records change
+#define EVENT_ORDER 1
+#define EVENT_TRADE 2
+#define EVENT_CLOSED 3
+#define EVENT_CANCEL 4
+#define EVENT_QUOTE 5
+#define EVENT_OLD_FILL 6
+#define EVENT_LEVEL 7
+#define EVENT_BOOK_RESET 8
+#define EVENT_RESTING 9
+#define EVENT_RESTING_RESET 10
+
+#define NO_LIMIT -1                 // For options such as those of STATUS and STATUSALL
+
 #define MAXORDERS 2000000000        // Not going all the way to MAX_INT, because various numbers might go above this
 #define MAXACCOUNTS 5000
 
@@ -72,23 +259,6 @@
 #define TOO_HIGH_ACCOUNT 3
 
 
-#define EXECUTION_TEMPLATE_1 "{\n\
-  \"ok\": true,\n\
-  \"account\": \"%s\",\n\
-  \"venue\": \"%s\",\n\
-  \"symbol\": \"%s\",\n\
-  \"order\":\n"
-
-#define EXECUTION_TEMPLATE_2 ",\n\
-  \"standingId\": %d,\n\
-  \"incomingId\": %d,\n\
-  \"price\": %d,\n\
-  \"filled\": %d,\n\
-  \"filledAt\": \"%s\",\n\
-  \"standingComplete\": %s,\n\
-  \"incomingComplete\": %s\n\
-}"
-
 #define INDENT_2 "  "
 #define INDENT_4 "    "
 
@@ -105,6 +275,7 @@ typedef struct FillNode_struct {
 } FILLNODE;
 
 typedef struct Account_struct {
+    int id;                         // The account_int the frontend gave it
     char name[SMALLSTRING];
     struct Order_struct ** orders;
     int arraylen;
@@ -160,6 +331,61 @@ typedef struct Quote_struct {       // Anything that can exceed 2^31-1 is an int
     char quoteTime[SMALLSTRING];
 } QUOTE;
 
+typedef struct PricePoint_struct {  // A level, whether or not it exists right now
+    int direction;
+    int price;
+} PRICEPOINT;
+
+typedef struct Event_struct {       // Something the frontend must be told about (see EVENTS above)
+    int type;
+    int book_id;
+    uint64_t seq;
+    uint64_t version;               // EVENT_QUOTE and the depth and book events
+    union {
+        struct {
+            int id;
+            int direction;
+            int orderType;
+            int qty;
+            int price;
+            char account[SMALLSTRING];
+            char ts[SMALLSTRING];
+        } order;
+        struct {
+            int standing;
+            int incoming;
+            int price;
+            int qty;
+            int standing_complete;
+            int incoming_complete;
+            char ts[SMALLSTRING];
+        } trade;
+        struct {
+            int id;
+            int price;
+            int qty;
+            char ts[SMALLSTRING];
+        } fill;
+        struct {
+            int direction;
+            int price;
+            int64_t qty;
+            int orders;
+            int more;
+        } level;                    // EVENT_LEVEL (and more is used by EVENT_BOOK_RESET)
+        struct {
+            int id;
+            int direction;
+            int price;
+            int qty;
+            int filled;
+            int more;
+        } resting;                  // EVENT_RESTING (and more is used by EVENT_RESTING_RESET)
+        int id;                     // EVENT_CLOSED and EVENT_CANCEL
+        QUOTE quote;
+    } data;
+} EVENT;
+
 typedef struct DebugInfo_struct {
     int inits_of_level;
     int inits_of_fill;
@@ -173,57 +399,270 @@ typedef struct DebugInfo_struct {
     int reallocs_of_account_order_list;
 } DEBUG_INFO;
 
+typedef struct Buffer_struct {      // Replies and events are built up in these before sending
+    char * data;
+    size_t len;
+    size_t size;
+} BUFFER;
+
+typedef struct Book_struct {        // Everything about one venue/symbol
+    int id;                         // Our number in the protocol (0 in library mode)
+    char venue[SMALLSTRING];
+    char symbol[SMALLSTRING];
+    char * starttime;
+
+    BUFFER reply;                   // Per book (not per thread) so that books are
+    BUFFER wsmessage;               // independent of each other in library mode
+
+    struct tm lasttime;             // For faking microseconds in timestamps
+    int fakemicro;
+
+    uint64_t eventseq;              // Last event sequence number used
+    uint64_t version;               // Bumped whenever the orderbook or quote changes
+    int wantticker;                 // Subscriptions, see SUBSCRIBE above
+    char * watched;                 // Indexed by account id
+    int watchedarraylen;
+    int wantdepth;
+    PRICEPOINT * touched;           // Levels changed since the last EVENT_LEVELs were sent (if wantdepth)
+    int touchedcount;
+    int touchedarraylen;
+    int wantbook;
+    struct Order_struct ** touchedorders;   // Resting orders changed since then (if wantbook)
+    int touchedorderscount;
+    int touchedordersarraylen;
+
+    struct Level_struct * firstbidlevel;
+    struct Level_struct * firstasklevel;
+
+    struct Order_struct ** allorders;
+    int orderarraylen;
+    int highestknownorder;
+    int nextid;
+
+    struct Account_struct ** allaccounts;   // The array of all accounts gets realloc'd as needed,
+    int accountarraylen;                    // but it should probably simply have a fixed size.
+
+    struct Quote_struct quote;
+    struct DebugInfo_struct debuginfo;
+
+    struct Shard_struct * shard;    // The thread that owns us (NULL in library mode)
+} BOOK;
+
+#if defined(USE_THREADS)
+
+typedef struct CommandQueue_struct {    // Main thread writes, one matching thread reads
+    uint64_t head;                      // Total commands ever written
+    char pad1[56];
+    uint64_t tail;                      // Total commands ever read
+    char pad2[56];
+    int consumer_waiting;
+    pthread_mutex_t mutex;              // Only used for sleeping when idle, never while busy
+    pthread_cond_t cond;
+    char (* slots)[MAXSTRING];
+} COMMAND_QUEUE;
+
+typedef struct EventQueue_struct {  // One matching thread writes, the emitter thread reads
+    uint64_t head;
+    char pad1[56];
+    uint64_t tail;
+    char pad2[56];
+    EVENT * slots;
+} EVENT_QUEUE;
 
-// ---------------------------------- GLOBALS -----------------------------------------------
+#endif
+
+typedef struct Shard_struct {       // A matching thread and everything that only it touches
+    int number;
+    int cpu;                        // -1 for no affinity
 
+    BOOK ** books;                  // Indexed by book number / NumShards, NULL where no such book
+    int bookarraylen;
+    BOOK * sparebook;               // Made in advance, while idle, for the next INIT
 
-char Venue[SMALLSTRING];
-char Symbol[SMALLSTRING];
-char * StartTime = NULL;
+    BUFFER reply;                   // For errors about unknown books
 
-LEVEL * FirstBidLevel = NULL;
-LEVEL * FirstAskLevel = NULL;
+    #if defined(USE_THREADS)
+        pthread_t thread;
+        COMMAND_QUEUE queue;
+        EVENT_QUEUE events;
+    #endif
+} SHARD;
+
+
+// ---------------------------------- GLOBALS -----------------------------------------------
 
-ORDER ** AllOrders = NULL;
-int CurrentOrderArrayLen = 0;
-int HighestKnownOrder = -1;
 
-ACCOUNT ** AllAccounts = NULL;      // The array of all accounts gets realloc'd as needed,
-int CurrentAccountArrayLen = 0;     // but it should probably simply have a fixed size.
+SHARD * Shards = NULL;
+int NumShards = 1;
+int UseEmitter = 0;
 
-QUOTE Quote = {0, 0, 0, 0, -1, -1, -1, -1, "", ""};
+#if defined(USE_THREADS)
+    pthread_mutex_t StdoutMutex = PTHREAD_MUTEX_INITIALIZER;    // Whole replies and batches of
+    pthread_mutex_t StderrMutex = PTHREAD_MUTEX_INITIALIZER;    // events are written under these
 
-DEBUG_INFO DebugInfo = {0};         // Think global is auto-zeroed anyway, but whatever
+    int EmitterWaiting = 0;
+    pthread_mutex_t EmitterMutex = PTHREAD_MUTEX_INITIALIZER;   // Only used for the emitter sleeping when idle
+    pthread_cond_t EmitterCond = PTHREAD_COND_INITIALIZER;
+    #define LOCK_STREAM(m) pthread_mutex_lock(&(m))
+    #define UNLOCK_STREAM(m) pthread_mutex_unlock(&(m))
+#else
+    #define LOCK_STREAM(m)
+    #define UNLOCK_STREAM(m)
+#endif
 
 
 // ------------------------------------------------------------------------------------------
 
 
-void end_message (FILE * outfile)
+void check_ptr_or_quit (void * ptr)
+{
+    if (ptr == NULL)
+    {
+        LOCK_STREAM(StdoutMutex);
+        printf("FATAL Out of memory! Quitting\n");     // Not a valid reply header, so the frontend will give up on us
+        fflush(stdout);
+        assert(ptr);
+        exit(1);
+    }
+    return;
+}
+
+
+void buf_grow (BUFFER * buf, size_t needed)        // Make room for needed more bytes, plus a '\0'
 {
-    fprintf(outfile, "\nEND\n");
-    fflush(outfile);
+    size_t newsize;
+
+    newsize = buf->size ? buf->size : 4096;
+
+    while (buf->len + needed + 1 > newsize)
+    {
+        newsize *= 2;
+    }
+
+    if (newsize != buf->size || buf->data == NULL)
+    {
+        buf->data = realloc(buf->data, newsize);
+        check_ptr_or_quit(buf->data);
+        buf->size = newsize;
+    }
+
     return;
 }
 
 
-void check_ptr_or_quit (void * ptr)
+void buf_printf (BUFFER * buf, const char * format, ...)
 {
-    if (ptr == NULL)
+    va_list args;
+    int n;
+
+    if (buf->data == NULL) buf_grow(buf, 0);
+
+    va_start(args, format);
+    n = vsnprintf(buf->data + buf->len, buf->size - buf->len, format, args);
+    va_end(args);
+
+    if (n < 0) return;
+
+    if ((size_t) n >= buf->size - buf->len)        // Didn't fit, so grow and go again
     {
-        printf("{\"ok\": false, \"error\": \"Out of memory! Quitting\"}");
-        end_message(stdout);
-        assert(ptr);
+        buf_grow(buf, n);
+        va_start(args, format);
+        vsnprintf(buf->data + buf->len, buf->size - buf->len, format, args);
+        va_end(args);
+    }
+
+    buf->len += n;
+    return;
+}
+
+
+void buf_putc (BUFFER * buf, int c)
+{
+    if (buf->len + 2 > buf->size) buf_grow(buf, 1);
+
+    buf->data[buf->len] = (char) c;
+    buf->len += 1;
+    return;
+}
+
+
+void buf_put32 (BUFFER * buf, uint32_t n)          // Big-endian
+{
+    buf_putc(buf, (n & 0xFF000000) >> 24);
+    buf_putc(buf, (n & 0x00FF0000) >> 16);
+    buf_putc(buf, (n & 0x0000FF00) >>  8);
+    buf_putc(buf, (n & 0x000000FF)      );
+    return;
+}
+
+
+void buf_put64 (BUFFER * buf, uint64_t n)          // Big-endian
+{
+    buf_put32(buf, (uint32_t) (n >> 32));
+    buf_put32(buf, (uint32_t) (n & 0xFFFFFFFF));
+    return;
+}
+
+
+void buf_putstr (BUFFER * buf, char * str)         // 1 byte of length, then the string (no '\0')
+{
+    size_t len;
+    size_t n;
+
+    len = strlen(str);
+    if (len > 255) len = 255;
+
+    buf_putc(buf, (int) len);
+    for (n = 0; n < len; n++)
+    {
+        buf_putc(buf, str[n]);
     }
     return;
 }
 
 
-LEVEL * init_level (int price, ORDERNODE * ordernode, LEVEL * prev, LEVEL * next)
+void send_reply (BUFFER * reply, int book_id, uint64_t version)
+{
+    // Sends whatever is in the reply buffer, then empties it.
+
+    LOCK_STREAM(StdoutMutex);
+    printf("REPLY %d %lu %llu\n", book_id, (unsigned long) reply->len, (unsigned long long) version);
+    fwrite(reply->data, 1, reply->len, stdout);
+    fflush(stdout);
+    UNLOCK_STREAM(StdoutMutex);
+
+    reply->len = 0;
+    return;
+}
+
+
+void send_ws_message (BOOK * book)
+{
+    // Sends whatever events are in the book's WebSocket buffer, then empties it. Doing
+    // it in one go (rather than many small writes) means one write to the pipe.
+    // In library mode, events just pile up until the caller collects them.
+    // (None of this is used when there's an emitter thread.)
+
+    #if !defined(DISORDERBOOK_LIBRARY)
+        LOCK_STREAM(StderrMutex);
+        fwrite(book->wsmessage.data, 1, book->wsmessage.len, stderr);
+        fflush(stderr);
+        UNLOCK_STREAM(StderrMutex);
+
+        book->wsmessage.len = 0;
+    #else
+        (void) book;
+    #endif
+
+    return;
+}
+
+
+LEVEL * init_level (BOOK * book, int price, ORDERNODE * ordernode, LEVEL * prev, LEVEL * next)
 {
     LEVEL * ret;
 
-    DebugInfo.inits_of_level++;
+    book->debuginfo.inits_of_level++;
 
     ret = malloc(sizeof(LEVEL));
     check_ptr_or_quit(ret);
@@ -237,11 +676,11 @@ LEVEL * init_level (int price, ORDERNODE * ordernode, LEVEL * prev, LEVEL * next
 }
 
 
-FILL * init_fill (int price, int qty, char * ts)
+FILL * init_fill (BOOK * book, int price, int qty, char * ts)
 {
     FILL * ret;
 
-    DebugInfo.inits_of_fill++;
+    book->debuginfo.inits_of_fill++;
 
     ret = malloc(sizeof(FILL));
     check_ptr_or_quit(ret);
@@ -254,11 +693,11 @@ FILL * init_fill (int price, int qty, char * ts)
 }
 
 
-FILLNODE * init_fillnode (FILL * fill, FILLNODE * prev, FILLNODE * next)
+FILLNODE * init_fillnode (BOOK * book, FILL * fill, FILLNODE * prev, FILLNODE * next)
 {
     FILLNODE * ret;
 
-    DebugInfo.inits_of_fillnode++;
+    book->debuginfo.inits_of_fillnode++;
 
     ret = malloc(sizeof(FILLNODE));
     check_ptr_or_quit(ret);
@@ -271,11 +710,11 @@ FILLNODE * init_fillnode (FILL * fill, FILLNODE * prev, FILLNODE * next)
 }
 
 
-ORDERNODE * init_ordernode (ORDER * order, ORDERNODE * prev, ORDERNODE * next)
+ORDERNODE * init_ordernode (BOOK * book, ORDER * order, ORDERNODE * prev, ORDERNODE * next)
 {
     ORDERNODE * ret;
 
-    DebugInfo.inits_of_ordernode++;
+    book->debuginfo.inits_of_ordernode++;
 
     ret = malloc(sizeof(ORDERNODE));
     check_ptr_or_quit(ret);
@@ -288,19 +727,17 @@ ORDERNODE * init_ordernode (ORDER * order, ORDERNODE * prev, ORDERNODE * next)
 }
 
 
-int next_id (int no_iterate_flag)
+int next_id (BOOK * book, int no_iterate_flag)
 {
-    static int id = 0;
-
-    if (id == MAXORDERS)         // Stop iterating
+    if (book->nextid == MAXORDERS)      // Stop iterating
     {
         return MAXORDERS;
     } else {
         if (no_iterate_flag)
         {
-            return id;
+            return book->nextid;
         } else {
-            return id++;
+            return book->nextid++;
         }
     }
 }
@@ -324,13 +761,15 @@ void safe_strcpy (char * dest, char * source, size_t size)
 }
 
 
-char * new_timestamp (void)
+char * new_timestamp (BOOK * book)
 {
     char * timestamp;
     time_t t;
     struct tm * ti;
-    static struct tm last_time = {0};
-    static int fake_micro = 0;
+
+    #if defined(USE_THREADS)
+        struct tm ti_storage;
+    #endif
 
     timestamp = malloc(SMALLSTRING);
     check_ptr_or_quit(timestamp);
@@ -339,7 +778,11 @@ char * new_timestamp (void)
 
     if (t != (time_t) -1)
     {
-        ti = gmtime(&t);
+        #if defined(USE_THREADS)
+            ti = gmtime_r(&t, &ti_storage);
+        #else
+            ti = gmtime(&t);
+        #endif
     } else {
         ti = NULL;
     }
@@ -347,22 +790,22 @@ char * new_timestamp (void)
     if (ti)
     {
         // We fake microseconds by using the number of times the
-        // function has been called this second as "microseconds",
-        // so first check if second has rolled over...
-        if (last_time.tm_year == ti->tm_year &&
-            last_time.tm_mon  == ti->tm_mon  &&
-            last_time.tm_mday == ti->tm_mday &&
-            last_time.tm_hour == ti->tm_hour &&
-            last_time.tm_min  == ti->tm_min  &&
-            last_time.tm_sec  == ti->tm_sec)
+        // function has been called this second (for this book) as
+        // "microseconds", so first check if second has rolled over...
+        if (book->lasttime.tm_year == ti->tm_year &&
+            book->lasttime.tm_mon  == ti->tm_mon  &&
+            book->lasttime.tm_mday == ti->tm_mday &&
+            book->lasttime.tm_hour == ti->tm_hour &&
+            book->lasttime.tm_min  == ti->tm_min  &&
+            book->lasttime.tm_sec  == ti->tm_sec)
         {
-            fake_micro += 1;
+            book->fakemicro += 1;
         } else {
-            fake_micro = 0;
-            last_time = *ti;
+            book->fakemicro = 0;
+            book->lasttime = *ti;
         }
         snprintf(timestamp, SMALLSTRING, "%d-%02d-%02dT%02d:%02d:%02d.%06dZ",
-                 ti->tm_year + 1900, ti->tm_mon + 1, ti->tm_mday, ti->tm_hour, ti->tm_min, ti->tm_sec, fake_micro);
+                 ti->tm_year + 1900, ti->tm_mon + 1, ti->tm_mday, ti->tm_hour, ti->tm_min, ti->tm_sec, book->fakemicro);
     } else {
         snprintf(timestamp, SMALLSTRING, "Unknown");
     }
@@ -371,12 +814,37 @@ char * new_timestamp (void)
 }
 
 
-ORDER * init_order (ACCOUNT * account, int qty, int price, int direction, int orderType, int id)
+void grow_order_storage (BOOK * book, int id)
 {
-    ORDER * ret;
     int n;
 
-    DebugInfo.inits_of_order++;
+    while (id >= book->orderarraylen)
+    {
+        book->allorders = realloc(book->allorders, (book->orderarraylen + 8192) * sizeof(ORDER *));
+        check_ptr_or_quit(book->allorders);
+        book->orderarraylen += 8192;
+
+        // NULLify the new pointers in case gaps open up somehow - we can
+        // verify the order ID doesn't exist... (should be impossible at
+        // time of writing but it's good practice).
+
+        for (n = book->orderarraylen - 8192; n < book->orderarraylen; n++)
+        {
+            book->allorders[n] = NULL;
+        }
+
+        book->debuginfo.reallocs_of_global_order_list++;
+    }
+
+    return;
+}
+
+
+ORDER * init_order (BOOK * book, ACCOUNT * account, int qty, int price, int direction, int orderType, int id)
+{
+    ORDER * ret;
+
+    book->debuginfo.inits_of_order++;
 
     ret = malloc(sizeof(ORDER));
     check_ptr_or_quit(ret);
@@ -388,32 +856,16 @@ ORDER * init_order (ACCOUNT * account, int qty, int price, int direction, int or
     ret->orderType = orderType;
     ret->id = id;
     ret->account = account;
-    ret->ts = new_timestamp();
+    ret->ts = new_timestamp(book);
     ret->firstfillnode = NULL;
     ret->totalFilled = 0;
     ret->open = 1;
 
     // Now deal with the global order storage...
 
-    while (id >= CurrentOrderArrayLen)
-    {
-        AllOrders = realloc(AllOrders, (CurrentOrderArrayLen + 8192) * sizeof(ORDER *));
-        check_ptr_or_quit(AllOrders);
-        CurrentOrderArrayLen += 8192;
-
-        // NULLify the new pointers in case gaps open up somehow - we can
-        // verify the order ID doesn't exist... (should be impossible at
-        // time of writing but it's good practice).
-
-        for (n = CurrentOrderArrayLen - 8192; n < CurrentOrderArrayLen; n++)
-        {
-            AllOrders[n] = NULL;
-        }
-
-        DebugInfo.reallocs_of_global_order_list++;
-    }
-    AllOrders[id] = ret;
-    HighestKnownOrder = id;
+    grow_order_storage(book, id);
+    book->allorders[id] = ret;
+    book->highestknownorder = id;
 
     return ret;
 }
@@ -516,6 +968,26 @@ int64_t get_size_from_level (LEVEL * level)
 }
 
 
+int count_orders_in_level (LEVEL * level)
+{
+    ORDERNODE * ordernode;
+    int ret;
+
+    ret = 0;
+
+    if (level == NULL)
+    {
+        return 0;
+    }
+
+    for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+    {
+        if (ordernode->order->open) ret++;
+    }
+    return ret;
+}
+
+
 int64_t get_depth (LEVEL * level)        // Returns size of this level and all worse levels (if level exists)
 {
     int64_t onesize;
@@ -531,7 +1003,46 @@ int64_t get_depth (LEVEL * level)        // Returns size of this level and all w
 }
 
 
-void print_quote (FILE * outfile)       // Just hard-codes the indent, meaning executions messages look odd. Meh.
+LEVEL * find_level (BOOK * book, int price, int dir)      // Return ptr to level, or return NULL if not present
+{
+    LEVEL * level = NULL;
+
+    if (dir == BUY)
+    {
+        level = book->firstbidlevel;
+        while (level != NULL)
+        {
+            if (level->price > price)
+            {
+                level = level->next;
+            } else if (level->price == price) {
+                break;
+            } else {
+                level = NULL;
+                break;
+            }
+        }
+    } else {
+        level = book->firstasklevel;
+        while (level != NULL)
+        {
+            if (level->price < price)
+            {
+                level = level->next;
+            } else if (level->price == price) {
+                break;
+            } else {
+                level = NULL;
+                break;
+            }
+        }
+    }
+
+    return level;
+}
+
+
+void print_quote (BUFFER * buf, BOOK * book, QUOTE * quote)       // Just hard-codes the indent, meaning executions messages look odd. Meh.
 {
     char buildup[MAXSTRING];
     char part[MAXSTRING];
@@ -539,61 +1050,69 @@ void print_quote (FILE * outfile)       // Just hard-codes the indent, meaning e
     // Add all the fields that are always present...
     snprintf(buildup, MAXSTRING, "{\n  \"ok\": true,\n  \"symbol\": \"%s\",\n  \"venue\": \"%s\",\n  \"bidSize\": %" PRId64 ",\n"
                                  "  \"askSize\": %" PRId64 ",\n  \"bidDepth\": %" PRId64 ",\n  \"askDepth\": %" PRId64 ",\n  \"quoteTime\": \"%s\"",
-             Symbol, Venue, Quote.bidSize, Quote.askSize, Quote.bidDepth, Quote.askDepth, Quote.quoteTime);
+             book->symbol, book->venue, quote->bidSize, quote->askSize, quote->bidDepth, quote->askDepth, quote->quoteTime);
 
-    if (Quote.bid >= 0)         // -1 used as a null value
+    if (quote->bid >= 0)             // -1 used as a null value
     {
-        snprintf(part, MAXSTRING, ",\n  \"bid\": %d", Quote.bid);
+        snprintf(part, MAXSTRING, ",\n  \"bid\": %d", quote->bid);
         strncat(buildup, part, MAXSTRING - strlen(buildup) - 1);
     }
 
-    if (Quote.ask >= 0)         // -1 used as a null value
+    if (quote->ask >= 0)             // -1 used as a null value
     {
-        snprintf(part, MAXSTRING, ",\n  \"ask\": %d", Quote.ask);
+        snprintf(part, MAXSTRING, ",\n  \"ask\": %d", quote->ask);
         strncat(buildup, part, MAXSTRING - strlen(buildup) - 1);
     }
 
-    if (Quote.lastTrade[0])     // i.e. check the timestamp of the last trade is a non-empty string
+    if (quote->lastTrade[0])         // i.e. check the timestamp of the last trade is a non-empty string
     {
-        snprintf(part, MAXSTRING, ",\n  \"lastTrade\": \"%s\",\n  \"lastSize\": %d,\n  \"last\": %d", Quote.lastTrade, Quote.lastSize, Quote.last);
+        snprintf(part, MAXSTRING, ",\n  \"lastTrade\": \"%s\",\n  \"lastSize\": %d,\n  \"last\": %d", quote->lastTrade, quote->lastSize, quote->last);
         strncat(buildup, part, MAXSTRING - strlen(buildup) - 1);
     }
 
     strncat(buildup, "\n}", MAXSTRING - strlen(buildup) - 1);
 
-    fprintf(outfile, "%s", buildup);
+    buf_printf(buf, "%s", buildup);
 
     return;
 }
 
 
-void print_fills (FILE * outfile, ORDER * order, char * indent1, char * indent2)
+void print_fills (BUFFER * buf, ORDER * order, char * indent1, char * indent2, int offset, int limit)
 {
     FILLNODE * fillnode;
+    FILLNODE * first;
+    int n;
+
+    first = order->firstfillnode;
+    for (n = 0; n < offset && first != NULL; n++)
+    {
+        first = first->next;
+    }
 
-    if (order->firstfillnode == NULL)   // Can do without this block but it's uglier
+    if (first == NULL || limit == 0)    // Can do without this block but it's uglier
     {
-        fprintf(outfile, "%s\"fills\": []", indent1);
+        buf_printf(buf, "%s\"fills\": []", indent1);
         return;
     }
 
-    fprintf(outfile, "%s\"fills\": [\n", indent1);
+    buf_printf(buf, "%s\"fills\": [\n", indent1);
 
-    fillnode = order->firstfillnode;
+    fillnode = first;
 
-    while (fillnode != NULL)
+    for (n = 0; fillnode != NULL && (limit == NO_LIMIT || n < limit); n++)
     {
-        if (fillnode != order->firstfillnode) fprintf(outfile, ",\n");
-        fprintf(outfile, "%s{\"price\": %d, \"qty\": %d, \"ts\": \"%s\"}", indent2, fillnode->fill->price, fillnode->fill->qty, fillnode->fill->ts);
+        if (fillnode != first) buf_printf(buf, ",\n");
+        buf_printf(buf, "%s{\"price\": %d, \"qty\": %d, \"ts\": \"%s\"}", indent2, fillnode->fill->price, fillnode->fill->qty, fillnode->fill->ts);
         fillnode = fillnode->next;
     }
 
-    fprintf(outfile, "\n%s]", indent1);
+    buf_printf(buf, "\n%s]", indent1);
     return;
 }
 
 
-void print_order (FILE * outfile, ORDER * order)
+void print_order (BUFFER * buf, BOOK * book, ORDER * order, int fill_offset, int fill_limit)
 {
     char orderType_to_print[SMALLSTRING];
 
@@ -610,1132 +1129,2632 @@ void print_order (FILE * outfile, ORDER * order)
         safe_strcpy(orderType_to_print, "unknown", SMALLSTRING);
     }
 
-    fprintf(outfile,
+    buf_printf(buf,
 
             "{\n  \"ok\": true,\n  \"venue\": \"%s\",\n  \"symbol\": \"%s\",\n  \"direction\": \"%s\",\n  \"originalQty\": %d,\n  \"qty\": %d,"
             "\n  \"price\": %d,\n  \"orderType\": \"%s\",\n  \"id\": %d,\n  \"account\": \"%s\",\n  \"ts\": \"%s\",\n  \"totalFilled\": %d,\n  \"open\": %s,\n",
 
-            Venue, Symbol, order->direction == BUY ? "buy" : "sell", order->originalQty, order->qty,
+            book->venue, book->symbol, order->direction == BUY ? "buy" : "sell", order->originalQty, order->qty,
             order->price, orderType_to_print, order->id, order->account->name, order->ts, order->totalFilled, order->open ? "true" : "false");
 
-    print_fills(outfile, order, INDENT_2, INDENT_4);
-    fprintf(outfile, "\n}");
+    print_fills(buf, order, INDENT_2, INDENT_4, fill_offset, fill_limit);
+    buf_printf(buf, "\n}");
 
     return;
 }
 
 
-void create_ticker_message (void)
+void serialize_event (BUFFER * buf, EVENT * event)
 {
-    fprintf(stderr, "TICKER %s %s %s\n", "NONE", Venue, Symbol);
+    // Writes one event record, in the format described at the top (EVENTS).
 
-    fprintf(stderr, "{\"ok\": true, \"quote\": ");
-    print_quote(stderr);
-    fprintf(stderr, "}");
+    size_t start;
+    uint32_t len;
 
-    end_message(stderr);
-    return;
-}
+    start = buf->len;
+    buf_put32(buf, 0);                  // Length, filled in below
+    buf_putc(buf, event->type);
+    buf_put32(buf, (uint32_t) event->book_id);
+    buf_put64(buf, event->seq);
 
+    switch (event->type)
+    {
+        case EVENT_ORDER:
+
+            buf_put32(buf, (uint32_t) event->data.order.id);
+            buf_putc(buf, event->data.order.direction);
+            buf_putc(buf, event->data.order.orderType);
+            buf_put32(buf, (uint32_t) event->data.order.qty);
+            buf_put32(buf, (uint32_t) event->data.order.price);
+            buf_putstr(buf, event->data.order.account);
+            buf_putstr(buf, event->data.order.ts);
+            break;
 
-void create_execution_messages(ORDER * standing, ORDER * incoming, int quantity, int price, char * ts)
-{
-    fprintf(stderr, "EXECUTION %s %s %s\n", standing->account->name, Venue, Symbol);
-    fprintf(stderr, EXECUTION_TEMPLATE_1, standing->account->name, Venue, Symbol);
-    print_order(stderr, standing);
-    fprintf(stderr, EXECUTION_TEMPLATE_2, standing->id, incoming->id, price, quantity, ts,
-            standing->open ? "false" : "true", incoming->open ? "false" : "true");
+        case EVENT_TRADE:
 
-    end_message(stderr);
+            buf_put32(buf, (uint32_t) event->data.trade.standing);
+            buf_put32(buf, (uint32_t) event->data.trade.incoming);
+            buf_put32(buf, (uint32_t) event->data.trade.price);
+            buf_put32(buf, (uint32_t) event->data.trade.qty);
+            buf_putstr(buf, event->data.trade.ts);
+            buf_putc(buf, event->data.trade.standing_complete);
+            buf_putc(buf, event->data.trade.incoming_complete);
+            break;
 
-    fprintf(stderr, "EXECUTION %s %s %s\n", incoming->account->name, Venue, Symbol);
-    fprintf(stderr, EXECUTION_TEMPLATE_1, incoming->account->name, Venue, Symbol);
-    print_order(stderr, incoming);
-    fprintf(stderr, EXECUTION_TEMPLATE_2, standing->id, incoming->id, price, quantity, ts,
-            standing->open ? "false" : "true", incoming->open ? "false" : "true");
+        case EVENT_OLD_FILL:
 
-    end_message(stderr);
-    return;
-}
+            buf_put32(buf, (uint32_t) event->data.fill.id);
+            buf_put32(buf, (uint32_t) event->data.fill.price);
+            buf_put32(buf, (uint32_t) event->data.fill.qty);
+            buf_putstr(buf, event->data.fill.ts);
+            break;
 
+        case EVENT_CLOSED:
+        case EVENT_CANCEL:
 
-// The following function remakes the parts of the quote that are
-// determined by the state of the book itself (i.e. NOT "last trade" info)
+            buf_put32(buf, (uint32_t) event->data.id);
+            break;
 
-void remake_most_of_quote (void)
-{
-    char * ts;
+        case EVENT_QUOTE:
+
+            buf_put32(buf, (uint32_t) event->data.quote.bid);
+            buf_put32(buf, (uint32_t) event->data.quote.ask);
+            buf_put64(buf, (uint64_t) event->data.quote.bidSize);
+            buf_put64(buf, (uint64_t) event->data.quote.askSize);
+            buf_put64(buf, (uint64_t) event->data.quote.bidDepth);
+            buf_put64(buf, (uint64_t) event->data.quote.askDepth);
+            buf_put32(buf, (uint32_t) event->data.quote.last);
+            buf_put32(buf, (uint32_t) event->data.quote.lastSize);
+            buf_putstr(buf, event->data.quote.lastTrade);
+            buf_putstr(buf, event->data.quote.quoteTime);
+            buf_put64(buf, event->version);
+            break;
 
-    Quote.bidSize = get_size_from_level(FirstBidLevel);
-    Quote.bidDepth = get_depth(FirstBidLevel);
-    Quote.askSize = get_size_from_level(FirstAskLevel);
-    Quote.askDepth = get_depth(FirstAskLevel);
+        case EVENT_LEVEL:
 
-    if (FirstBidLevel)
-    {
-        Quote.bid = FirstBidLevel->price;
-    } else {
-        Quote.bid = -1;
-    }
+            buf_put64(buf, event->version);
+            buf_putc(buf, event->data.level.direction);
+            buf_put32(buf, (uint32_t) event->data.level.price);
+            buf_put64(buf, (uint64_t) event->data.level.qty);
+            buf_put32(buf, (uint32_t) event->data.level.orders);
+            buf_putc(buf, event->data.level.more);
+            break;
 
-    if (FirstAskLevel)
-    {
-        Quote.ask = FirstAskLevel->price;
-    } else {
-        Quote.ask = -1;
-    }
+        case EVENT_BOOK_RESET:
 
-    ts = new_timestamp();
-    safe_strcpy(Quote.quoteTime, ts, SMALLSTRING);
-    free(ts);
+            buf_put64(buf, event->version);
+            buf_putc(buf, event->data.level.more);
+            break;
 
-    // We can't touch last, lastSize, or lastTrade
-    // as this function is called often even when
-    // no actual fill has happened.
+        case EVENT_RESTING:
+
+            buf_put64(buf, event->version);
+            buf_put32(buf, (uint32_t) event->data.resting.id);
+            buf_putc(buf, event->data.resting.direction);
+            buf_put32(buf, (uint32_t) event->data.resting.price);
+            buf_put32(buf, (uint32_t) event->data.resting.qty);
+            buf_put32(buf, (uint32_t) event->data.resting.filled);
+            buf_putc(buf, event->data.resting.more);
+            break;
+
+        case EVENT_RESTING_RESET:
+
+            buf_put64(buf, event->version);
+            buf_putc(buf, event->data.resting.more);
+            break;
+    }
+
+    len = (uint32_t) (buf->len - start - 4);
+    buf->data[start]     = (char) ((len & 0xFF000000) >> 24);
+    buf->data[start + 1] = (char) ((len & 0x00FF0000) >> 16);
+    buf->data[start + 2] = (char) ((len & 0x0000FF00) >>  8);
+    buf->data[start + 3] = (char) ((len & 0x000000FF)      );
 
     return;
 }
 
 
-void set_quote_lastinfo (int last, int lastSize)
+#if defined(USE_THREADS)
+
+EVENT * claim_event (BOOK * book)       // Matching thread only. Fill it in, then publish_event().
 {
-    char * ts;
+    EVENT_QUEUE * queue;
+    uint64_t head;
 
-    Quote.last = last;
-    Quote.lastSize = lastSize;
+    queue = &book->shard->events;
+    head = queue->head;
 
-    ts = new_timestamp();
-    safe_strcpy(Quote.lastTrade, ts, SMALLSTRING);
-    free(ts);
+    while (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == EVENT_QUEUE_SLOTS)
+    {
+        sched_yield();              // Full. Only happens if the frontend isn't keeping up with stderr.
+    }
 
-    return;
+    return &queue->slots[head & (EVENT_QUEUE_SLOTS - 1)];
 }
 
 
-void cross (ORDER * standing, ORDER * incoming)
+void publish_event (BOOK * book)
 {
-    int quantity;
-    int price;
-    char * ts;
-    FILLNODE * currentfillnode;
-    FILL * fill;
+    EVENT_QUEUE * queue;
 
-    ts = new_timestamp();
+    queue = &book->shard->events;
 
-    if (standing->qty < incoming->qty)
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&EmitterWaiting, __ATOMIC_SEQ_CST))
     {
-        quantity = standing->qty;
-    } else {
-        quantity = incoming->qty;
+        pthread_mutex_lock(&EmitterMutex);
+        pthread_cond_signal(&EmitterCond);
+        pthread_mutex_unlock(&EmitterMutex);
     }
 
-    standing->qty -= quantity;
-    standing->totalFilled += quantity;
-    incoming->qty -= quantity;
-    incoming->totalFilled += quantity;
+    return;
+}
 
-    price = standing->price;
+#endif
 
-    fill = init_fill(price, quantity, ts);
 
-    // Figure out where to put the fill...
+EVENT * new_event (BOOK * book, int type, EVENT * local)
+{
+    // Returns the event to fill in: a slot in the emitter's queue if there is an
+    // emitter, otherwise the caller's local one. Either way, pass it to send_event().
 
-    if (standing->firstfillnode == NULL)
-    {
-        standing->firstfillnode = init_fillnode(fill, NULL, NULL);
-    } else {
-        currentfillnode = standing->firstfillnode;
-        while (currentfillnode->next != NULL)
-        {
-            currentfillnode = currentfillnode->next;
-        }
-        currentfillnode->next = init_fillnode(fill, currentfillnode, NULL);
-    }
+    EVENT * event;
 
-    // Again for other order...
+    event = local;
 
-    if (incoming->firstfillnode == NULL)
-    {
-        incoming->firstfillnode = init_fillnode(fill, NULL, NULL);
-    } else {
-        currentfillnode = incoming->firstfillnode;
-        while (currentfillnode->next != NULL)
-        {
-            currentfillnode = currentfillnode->next;
-        }
-        currentfillnode->next = init_fillnode(fill, currentfillnode, NULL);
-    }
+    #if defined(USE_THREADS)
+        if (UseEmitter) event = claim_event(book);
+    #endif
 
-    if (standing->qty == 0) standing->open = 0;
-    if (incoming->qty == 0) incoming->open = 0;
+    event->type = type;
+    event->book_id = book->id;
+    event->seq = ++book->eventseq;
 
-    // Fix the positions of the 2 accounts...
+    return event;
+}
 
-    if (strcmp(standing->account->name, incoming->account->name))       // Transactions with self do nothing
-    {
-        if (standing->direction == BUY)
+
+void send_event (BOOK * book, EVENT * event)
+{
+    #if defined(USE_THREADS)
+        if (UseEmitter)
         {
-            update_account(standing->account, quantity, price, BUY);
-            update_account(incoming->account, quantity, price, SELL);
-        } else {
-            update_account(standing->account, quantity, price, SELL);
-            update_account(incoming->account, quantity, price, BUY);
+            publish_event(book);
+            return;
         }
-    }
+    #endif
 
-    set_quote_lastinfo(price, quantity);    // The rest of the quote will be generated by the function
-                                            // execute_order() when the whole execution is finished
+    serialize_event(&book->wsmessage, event);
+    send_ws_message(book);
+    return;
+}
 
-    create_execution_messages(standing, incoming, quantity, price, ts);
 
-    return;
+int account_watched (BOOK * book, ACCOUNT * account)
+{
+    return account->id < book->watchedarraylen && book->watched[account->id];
 }
 
 
-void run_order (ORDER * order)
+void announce_order (BOOK * book, ORDER * order)
 {
-    LEVEL * current_level;
-    ORDERNODE * current_node;
+    // The frontend needs to know about every order it might print in
+    // execution messages later.
 
-    if (order->direction == SELL)
-    {
-        for (current_level = FirstBidLevel; current_level != NULL; current_level = current_level->next)
-        {
-            if (current_level->price < order->price && order->orderType != MARKET) return;
+    EVENT local;
+    EVENT * event;
 
-            for (current_node = current_level->firstordernode; current_node != NULL; current_node = current_node->next)
-            {
-                cross(current_node->order, order);
-                if (order->open == 0) return;
-            }
-        }
-    } else {
-        for (current_level = FirstAskLevel; current_level != NULL; current_level = current_level->next)
-        {
-            if (current_level->price > order->price && order->orderType != MARKET) return;
+    if (account_watched(book, order->account) == 0) return;
 
-            for (current_node = current_level->firstordernode; current_node != NULL; current_node = current_node->next)
-            {
-                cross(current_node->order, order);
-                if (order->open == 0) return;
-            }
-        }
-    }
+    event = new_event(book, EVENT_ORDER, &local);
+    event->data.order.id = order->id;
+    event->data.order.direction = order->direction;
+    event->data.order.orderType = order->orderType;
+    event->data.order.qty = order->originalQty;
+    event->data.order.price = order->price;
+    safe_strcpy(event->data.order.account, order->account->name, SMALLSTRING);
+    safe_strcpy(event->data.order.ts, order->ts, SMALLSTRING);
+    send_event(book, event);
 
     return;
 }
 
 
-void cleanup_closed_bids_or_asks (LEVEL ** root_level)  // root_level is pointing to FirstBidLevel or FirstAskLevel, themselves pointers
+void announce_old_fills (BOOK * book, ORDER * order)
 {
-    LEVEL * current_level;
-    LEVEL * old_level;
-    ORDERNODE * current_node;
-    ORDERNODE * old_node;
-
-    if (*root_level == NULL) return;
-
-    current_level = *root_level;                        // Due to the double indirection, current_level still a pointer to a LEVEL
-    current_node = current_level->firstordernode;
-    assert(current_node != NULL);
+    EVENT local;
+    EVENT * event;
+    FILLNODE * fillnode;
 
-    while (1)
+    for (fillnode = order->firstfillnode; fillnode != NULL; fillnode = fillnode->next)
     {
-        if (current_node->order->open)                  // We found the very first (highest priority) open order
-        {
-            current_level->firstordernode = current_node;
-            current_level->prev = NULL;
-            current_node->prev = NULL;
-            *root_level = current_level;                // Remembering that current_level is a pointer, so
-            return;                                     // FirstBidLevel or FirstAskLevel ends up pointing to the level
-        }
-
-        if (current_node->next != NULL)
-        {
-            old_node = current_node;
-            current_node = current_node->next;
-            free(old_node);
-        } else {
-            old_node = current_node;
-            old_level = current_level;
-            current_level = current_level->next;
-            free(old_node);
-            free(old_level);
-            if (current_level != NULL)
-            {
-                current_node = current_level->firstordernode;
-                assert(current_node != NULL);
-            } else {
-                *root_level = NULL;
-                return;
-            }
-        }
+        event = new_event(book, EVENT_OLD_FILL, &local);
+        event->data.fill.id = order->id;
+        event->data.fill.price = fillnode->fill->price;
+        event->data.fill.qty = fillnode->fill->qty;
+        safe_strcpy(event->data.fill.ts, fillnode->fill->ts, SMALLSTRING);
+        send_event(book, event);
     }
 
     return;
 }
 
 
-void insert_ask (ORDER * order)
+void announce_trade (BOOK * book, ORDER * standing, ORDER * incoming, int quantity, int price, char * ts)
 {
-    ORDERNODE * ordernode;
-    ORDERNODE * current_node;
-    LEVEL * prev_level = NULL;
-    LEVEL * level;
-    LEVEL * newlevel;
+    EVENT local;
+    EVENT * event;
 
-    ordernode = init_ordernode(order, NULL, NULL);      // Fix ->prev later
+    if (account_watched(book, standing->account) == 0 && account_watched(book, incoming->account) == 0) return;
 
-    if (FirstAskLevel == NULL)
-    {
-        FirstAskLevel = init_level(order->price, ordernode, NULL, NULL);
-        return;
-    } else {
-        level = FirstAskLevel;
-    }
-
-    while (1)
-    {
-        if (order->price < level->price)
-        {
-            // Create new level...
-
-            newlevel = init_level(order->price, ordernode, prev_level, level);
-            level->prev = newlevel;
-            if (prev_level)
-            {
-                prev_level->next = newlevel;
-            } else {
-                FirstAskLevel = newlevel;
-            }
-            return;
+    event = new_event(book, EVENT_TRADE, &local);
+    event->data.trade.standing = standing->id;
+    event->data.trade.incoming = incoming->id;
+    event->data.trade.price = price;
+    event->data.trade.qty = quantity;
+    event->data.trade.standing_complete = standing->open ? 0 : 1;
+    event->data.trade.incoming_complete = incoming->open ? 0 : 1;
+    safe_strcpy(event->data.trade.ts, ts, SMALLSTRING);
+    send_event(book, event);
 
-        } else if (order->price == level->price) {
+    return;
+}
 
-            break;
 
-        } else {
+void announce_closed (BOOK * book, ORDER * order, int type)      // type is EVENT_CLOSED or EVENT_CANCEL
+{
+    EVENT local;
+    EVENT * event;
 
-            // Iterate...
+    if (account_watched(book, order->account) == 0) return;
 
-            prev_level = level;
-            if (level->next != NULL)
-            {
-                level = level->next;
-            } else {
-                level->next = init_level(order->price, ordernode, prev_level, NULL);
-                return;
-            }
-        }
-    }
+    event = new_event(book, type, &local);
+    event->data.id = order->id;
+    send_event(book, event);
 
-    // So we should be on the right level now
+    return;
+}
 
-    assert(level->price == order->price);
 
-    current_node = level->firstordernode;
-    assert(current_node != NULL);
+void announce_quote (BOOK * book)
+{
+    EVENT local;
+    EVENT * event;
 
-    while (current_node->next != NULL)
-    {
-        current_node = current_node->next;
-    }
+    if (book->wantticker == 0) return;
 
-    current_node->next = ordernode;
-    ordernode->prev = current_node;
+    event = new_event(book, EVENT_QUOTE, &local);
+    event->data.quote = book->quote;
+    event->version = book->version;
+    send_event(book, event);
 
     return;
 }
 
 
-void insert_bid (ORDER * order)
+void touch_level (BOOK * book, int direction, int price)
 {
-    ORDERNODE * ordernode;
-    ORDERNODE * current_node;
-    LEVEL * prev_level = NULL;
-    LEVEL * level;
-    LEVEL * newlevel;
+    // Notes that a level has (or may have) changed, for announce_levels().
 
-    ordernode = init_ordernode(order, NULL, NULL);      // Fix ->prev later
+    int n;
+
+    if (book->wantdepth == 0) return;
 
-    if (FirstBidLevel == NULL)
+    for (n = 0; n < book->touchedcount; n++)
     {
-        FirstBidLevel = init_level(order->price, ordernode, NULL, NULL);
-        return;
-    } else {
-        level = FirstBidLevel;
+        if (book->touched[n].direction == direction && book->touched[n].price == price) return;
     }
 
-    while (1)
+    if (book->touchedcount == book->touchedarraylen)
     {
-        if (order->price > level->price)
-        {
-            // Create new level...
+        book->touched = realloc(book->touched, (book->touchedarraylen + 16) * sizeof(PRICEPOINT));
+        check_ptr_or_quit(book->touched);
+        book->touchedarraylen += 16;
+    }
 
-            newlevel = init_level(order->price, ordernode, prev_level, level);
-            level->prev = newlevel;
-            if (prev_level)
-            {
-                prev_level->next = newlevel;
-            } else {
-                FirstBidLevel = newlevel;
-            }
-            return;
+    book->touched[book->touchedcount].direction = direction;
+    book->touched[book->touchedcount].price = price;
+    book->touchedcount++;
 
-        } else if (order->price == level->price) {
+    return;
+}
 
-            break;
 
-        } else {
+void announce_level (BOOK * book, int direction, int price, LEVEL * level, int more)
+{
+    EVENT local;
+    EVENT * event;
+
+    event = new_event(book, EVENT_LEVEL, &local);
+    event->version = book->version;
+    event->data.level.direction = direction;
+    event->data.level.price = price;
+    event->data.level.qty = get_size_from_level(level);
+    event->data.level.orders = count_orders_in_level(level);
+    event->data.level.more = more;
+    send_event(book, event);
 
-            // Iterate...
+    return;
+}
 
-            prev_level = level;
-            if (level->next != NULL)
-            {
-                level = level->next;
-            } else {
-                level->next = init_level(order->price, ordernode, prev_level, NULL);
-                return;
-            }
-        }
-    }
 
-    // So we should be on the right level now
+void announce_levels (BOOK * book)
+{
+    // Called whenever the version changes: sends the new state of every level touched.
 
-    assert(level->price == order->price);
+    PRICEPOINT * point;
+    int n;
 
-    current_node = level->firstordernode;
-    assert(current_node != NULL);
+    if (book->wantdepth == 0) return;
 
-    while (current_node->next != NULL)
+    for (n = 0; n < book->touchedcount; n++)
     {
-        current_node = current_node->next;
+        point = &book->touched[n];
+        announce_level(book, point->direction, point->price, find_level(book, point->price, point->direction), n < book->touchedcount - 1);
     }
 
-    current_node->next = ordernode;
-    ordernode->prev = current_node;
-
+    book->touchedcount = 0;
     return;
 }
 
 
-int fok_can_buy (int qty, int price)
+void watch_depth (BOOK * book, int watch)
 {
-    // Must use subtraction only. Adding could overflow.
+    // Starting (or restarting) sends the whole book; see EVENT_BOOK_RESET above.
 
+    EVENT local;
+    EVENT * event;
     LEVEL * level;
-    ORDERNODE * ordernode;
+    int i;
 
-    for (level = FirstAskLevel; level != NULL && level->price <= price; level = level->next)
+    book->wantdepth = watch ? 1 : 0;
+    book->touchedcount = 0;
+
+    if (book->wantdepth == 0) return;
+
+    event = new_event(book, EVENT_BOOK_RESET, &local);
+    event->version = book->version;
+    event->data.level.more = (book->firstbidlevel != NULL || book->firstasklevel != NULL);
+    send_event(book, event);
+
+    for (i = 0; i < 2; i++)
     {
-        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+        for (level = (i == 0 ? book->firstbidlevel : book->firstasklevel); level != NULL; level = level->next)
         {
-            qty -= ordernode->order->qty;
-            if (qty <= 0) return 1;
+            announce_level(book, i == 0 ? BUY : SELL, level->price, level, level->next != NULL || (i == 0 && book->firstasklevel != NULL));
         }
     }
 
-    return 0;
+    return;
 }
 
 
-int fok_can_sell (int qty, int price)
+void touch_order (BOOK * book, ORDER * order)
 {
-    // Must use subtraction only. Adding could overflow.
+    // Notes that a resting order has changed, for announce_resting_orders().
+    // An order is only touched once per change of version, so no need to dedupe.
 
-    LEVEL * level;
-    ORDERNODE * ordernode;
+    if (book->wantbook == 0) return;
 
-    for (level = FirstBidLevel; level != NULL && level->price >= price; level = level->next)
+    if (book->touchedorderscount == book->touchedordersarraylen)
     {
-        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
-        {
-            qty -= ordernode->order->qty;
-            if (qty <= 0) return 1;
-        }
+        book->touchedorders = realloc(book->touchedorders, (book->touchedordersarraylen + 16) * sizeof(ORDER *));
+        check_ptr_or_quit(book->touchedorders);
+        book->touchedordersarraylen += 16;
     }
 
-    return 0;
+    book->touchedorders[book->touchedorderscount] = order;
+    book->touchedorderscount++;
+
+    return;
 }
 
 
-ACCOUNT * init_account (char * name)
+void announce_resting (BOOK * book, ORDER * order, int more)
 {
-    ACCOUNT * ret;
+    EVENT local;
+    EVENT * event;
+
+    event = new_event(book, EVENT_RESTING, &local);
+    event->version = book->version;
+    event->data.resting.id = order->id;
+    event->data.resting.direction = order->direction;
+    event->data.resting.price = order->price;
+    event->data.resting.qty = order->open ? order->qty : 0;
+    event->data.resting.filled = order->totalFilled;
+    event->data.resting.more = more;
+    send_event(book, event);
 
-    DebugInfo.inits_of_account++;
+    return;
+}
 
-    ret = malloc(sizeof(ACCOUNT));
-    check_ptr_or_quit(ret);
 
-    safe_strcpy(ret->name, name, SMALLSTRING);
+void announce_resting_orders (BOOK * book)
+{
+    // Called whenever the version changes: sends the new state of every resting order touched.
 
-    ret->orders = NULL;
-    ret->arraylen = 0;
-    ret->count = 0;
+    int n;
 
-    ret->posmin = 0;
-    ret->posmax = 0;
-    ret->shares = 0;
-    ret->cents = 0;
+    if (book->wantbook == 0) return;
 
-    return ret;
+    for (n = 0; n < book->touchedorderscount; n++)
+    {
+        announce_resting(book, book->touchedorders[n], n < book->touchedorderscount - 1);
+    }
+
+    book->touchedorderscount = 0;
+    return;
 }
 
 
-ACCOUNT * account_lookup_or_create (char * account_name, int account_int)
+void watch_book (BOOK * book, int watch)
 {
-    int n;
+    // Starting (or restarting) sends every resting order; see EVENT_RESTING_RESET above.
+    // Bids come first, then asks, each best price first and in priority order.
 
-    // If account_id is too high, we will need more storage...
+    EVENT local;
+    EVENT * event;
+    LEVEL * level;
+    ORDERNODE * ordernode;
+    int i;
 
-    while (account_int >= CurrentAccountArrayLen)
-    {
-        AllAccounts = realloc(AllAccounts, (CurrentAccountArrayLen + 64) * sizeof(ACCOUNT *));
-        check_ptr_or_quit(AllAccounts);
-        CurrentAccountArrayLen += 64;
+    book->wantbook = watch ? 1 : 0;
+    book->touchedorderscount = 0;
 
-        // We must NULLify our new account pointers because there can be holes in the known
-        // account IDs: e.g. known IDs are 0,1,2,3,7. So, if we're asked to lookup ID 5, we
-        // need a way to know it doesn't exist...
+    if (book->wantbook == 0) return;
+
+    event = new_event(book, EVENT_RESTING_RESET, &local);
+    event->version = book->version;
+    event->data.resting.more = (book->firstbidlevel != NULL || book->firstasklevel != NULL);
+    send_event(book, event);
 
-        for (n = CurrentAccountArrayLen - 64; n < CurrentAccountArrayLen; n++)
+    for (i = 0; i < 2; i++)
+    {
+        for (level = (i == 0 ? book->firstbidlevel : book->firstasklevel); level != NULL; level = level->next)
         {
-            AllAccounts[n] = NULL;
+            for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+            {
+                announce_resting(book, ordernode->order, ordernode->next != NULL || level->next != NULL || (i == 0 && book->firstasklevel != NULL));
+            }
         }
-
-        DebugInfo.reallocs_of_global_account_list++;
     }
 
-    // If the account corresponsing to the account_id is NULL, create it...
+    return;
+}
 
-    if (AllAccounts[account_int] == NULL)
-    {
-        AllAccounts[account_int] = init_account(account_name);
+void watch_account (BOOK * book, int account_int, int watch)
+{
+    // Starts or stops sending events about this account's orders. The frontend
+    // is told about (or told to forget) any orders it has open right now.
+
+    ACCOUNT * account;
+    int n;
+
+    if (account_int < 0 || account_int >= MAXACCOUNTS) return;
+
+    while (account_int >= book->watchedarraylen)
+    {
+        book->watched = realloc(book->watched, book->watchedarraylen + 64);
+        check_ptr_or_quit(book->watched);
+        memset(book->watched + book->watchedarraylen, 0, 64);
+        book->watchedarraylen += 64;
     }
 
-    // Done...
+    watch = watch ? 1 : 0;
+    if (book->watched[account_int] == watch) return;
+
+    account = account_int < book->accountarraylen ? book->allaccounts[account_int] : NULL;
+
+    if (account && watch == 0)
+    {
+        for (n = 0; n < account->count; n++)
+        {
+            if (account->orders[n]->open) announce_closed(book, account->orders[n], EVENT_CLOSED);
+        }
+    }
+
+    book->watched[account_int] = (char) watch;
+
+    if (account && watch)
+    {
+        for (n = 0; n < account->count; n++)
+        {
+            if (account->orders[n]->open)
+            {
+                announce_order(book, account->orders[n]);
+                announce_old_fills(book, account->orders[n]);
+            }
+        }
+    }
 
-    return AllAccounts[account_int];
+    return;
 }
 
 
-void add_order_to_account (ORDER * order, ACCOUNT * accountobject)
+// The following function remakes the parts of the quote that are
+// determined by the state of the book itself (i.e. NOT "last trade" info)
+
+void remake_most_of_quote (BOOK * book)
 {
-    if (accountobject->count == accountobject->arraylen)
+    char * ts;
+
+    book->quote.bidSize = get_size_from_level(book->firstbidlevel);
+    book->quote.bidDepth = get_depth(book->firstbidlevel);
+    book->quote.askSize = get_size_from_level(book->firstasklevel);
+    book->quote.askDepth = get_depth(book->firstasklevel);
+
+    if (book->firstbidlevel)
     {
-        accountobject->orders = realloc(accountobject->orders, (accountobject->arraylen + 256) * sizeof(ORDER *));
-        check_ptr_or_quit(accountobject->orders);
-        accountobject->arraylen += 256;
+        book->quote.bid = book->firstbidlevel->price;
+    } else {
+        book->quote.bid = -1;
+    }
 
-        DebugInfo.reallocs_of_account_order_list++;
+    if (book->firstasklevel)
+    {
+        book->quote.ask = book->firstasklevel->price;
+    } else {
+        book->quote.ask = -1;
     }
-    accountobject->orders[accountobject->count] = order;
-    accountobject->count += 1;
+
+    ts = new_timestamp(book);
+    safe_strcpy(book->quote.quoteTime, ts, SMALLSTRING);
+    free(ts);
+
+    // We can't touch last, lastSize, or lastTrade
+    // as this function is called often even when
+    // no actual fill has happened.
 
     return;
 }
 
 
-ORDER_AND_ERROR * execute_order (char * account_name, int account_int, int qty, int price, int direction, int orderType)
+void set_quote_lastinfo (BOOK * book, int last, int lastSize)
 {
-    // Note: account_name will be in the stack of the calling function, not in the heap
+    char * ts;
 
-    ORDER * order;
-    ORDER_AND_ERROR * o_and_e;
-    int id;
-    ACCOUNT * accountobject;
+    book->quote.last = last;
+    book->quote.lastSize = lastSize;
 
-    // The o_and_e structure lets us send either an order or an error to the caller...
+    ts = new_timestamp(book);
+    safe_strcpy(book->quote.lastTrade, ts, SMALLSTRING);
+    free(ts);
 
-    o_and_e = init_o_and_e();
+    return;
+}
 
-    // Check for too high an order ID, too high an account ID, or silly values...
 
-    if (next_id(1) >= MAXORDERS)                // Pass the no-iterate flag to next_id() here
-    {                                           // i.e. don't iterate until we know order succeeds
-        o_and_e->error = TOO_MANY_ORDERS;
-        return o_and_e;
+void cross (BOOK * book, ORDER * standing, ORDER * incoming)
+{
+    int quantity;
+    int price;
+    char * ts;
+    FILLNODE * currentfillnode;
+    FILL * fill;
 
-    } else if (account_int >= MAXACCOUNTS)
-    {
-        o_and_e->error = TOO_HIGH_ACCOUNT;
-        return o_and_e;
+    ts = new_timestamp(book);
 
-    } else if (price < 0 || qty < 1 || (direction != SELL && direction != BUY))
+    if (standing->qty < incoming->qty)
     {
-        o_and_e->error = SILLY_VALUE;
-        return o_and_e;
+        quantity = standing->qty;
+    } else {
+        quantity = incoming->qty;
     }
 
-    // The following call gets the account object. If not already extant, it is created.
-    // If more memory is needed to store accounts up to this account_id, that happens...
+    touch_level(book, standing->direction, standing->price);
+    touch_order(book, standing);
 
-    accountobject = account_lookup_or_create(account_name, account_int);
+    standing->qty -= quantity;
+    standing->totalFilled += quantity;
+    incoming->qty -= quantity;
+    incoming->totalFilled += quantity;
 
-    // Create order struct, and store a pointer to it in the account...
+    price = standing->price;
 
-    id = next_id(0);
-    order = init_order(accountobject, qty, price, direction, orderType, id);
-    add_order_to_account(order, accountobject);
+    fill = init_fill(book, price, quantity, ts);
 
-    // Run the order, with checks for FOK if needed...
+    // Figure out where to put the fill...
 
-    if (order->orderType != FOK)
+    if (standing->firstfillnode == NULL)
     {
-        run_order(order);
+        standing->firstfillnode = init_fillnode(book, fill, NULL, NULL);
     } else {
-        if (order->direction == BUY)
+        currentfillnode = standing->firstfillnode;
+        while (currentfillnode->next != NULL)
         {
-            if (fok_can_buy(order->qty, order->price))
-            {
-                run_order(order);
-            }
-        } else {
-            if (fok_can_sell(order->qty, order->price))
-            {
-                run_order(order);
-            }
+            currentfillnode = currentfillnode->next;
         }
+        currentfillnode->next = init_fillnode(book, fill, currentfillnode, NULL);
     }
 
-    // Iterate through the Bids or Asks as appropriate, removing them from the book if they are now closed...
+    // Again for other order...
 
-    if (order->direction == SELL)
+    if (incoming->firstfillnode == NULL)
     {
-        cleanup_closed_bids_or_asks(&FirstBidLevel);
+        incoming->firstfillnode = init_fillnode(book, fill, NULL, NULL);
     } else {
-        cleanup_closed_bids_or_asks(&FirstAskLevel);
+        currentfillnode = incoming->firstfillnode;
+        while (currentfillnode->next != NULL)
+        {
+            currentfillnode = currentfillnode->next;
+        }
+        currentfillnode->next = init_fillnode(book, fill, currentfillnode, NULL);
     }
 
-    // Market orders get set to price == 0 in official for storage / reporting
-    // (the timing doesn't matter, this could be done before running the order)
-
-    if (order->orderType == MARKET) order->price = 0;
+    if (standing->qty == 0) standing->open = 0;
+    if (incoming->qty == 0) incoming->open = 0;
 
-    // Place open limit orders on the book. Mark other order types as closed...
+    // Fix the positions of the 2 accounts...
 
-    if (order->open)
+    if (strcmp(standing->account->name, incoming->account->name))       // Transactions with self do nothing
     {
-        if (order->orderType == LIMIT)
+        if (standing->direction == BUY)
         {
-            if (order->direction == SELL)
-            {
-                insert_ask(order);
-            } else {
-                insert_bid(order);
-            }
+            update_account(standing->account, quantity, price, BUY);
+            update_account(incoming->account, quantity, price, SELL);
         } else {
-            order->open = 0;
-            order->qty = 0;
+            update_account(standing->account, quantity, price, SELL);
+            update_account(incoming->account, quantity, price, BUY);
         }
     }
 
-    // If something happened, fix the quote and fire a ticker WebSocket message.
-    // The definition of "something happened" is anything that changes the book:
-    //      - a limit order was placed, OR
-    //      - fills were generated
-    // Nothing else changes the book except cancels, which we aren't dealing with here.
+    set_quote_lastinfo(book, price, quantity);    // The rest of the quote will be generated by the function
+                                            // execute_order() when the whole execution is finished
 
-    if (order->totalFilled || order->orderType == LIMIT)
-    {
-        remake_most_of_quote();     // the "last trade" parts are done by cross()
-        create_ticker_message();
-    }
+    announce_trade(book, standing, incoming, quantity, price, ts);
 
-    o_and_e->order = order;
-    return o_and_e;
+    return;
 }
 
 
-LEVEL * find_level (int price, int dir)      // Return ptr to level, or return NULL if not present
+void run_order (BOOK * book, ORDER * order)
 {
-    LEVEL * level = NULL;
+    LEVEL * current_level;
+    ORDERNODE * current_node;
 
-    if (dir == BUY)
+    if (order->direction == SELL)
     {
-        level = FirstBidLevel;
-        while (level != NULL)
+        for (current_level = book->firstbidlevel; current_level != NULL; current_level = current_level->next)
         {
-            if (level->price > price)
+            if (current_level->price < order->price && order->orderType != MARKET) return;
+
+            for (current_node = current_level->firstordernode; current_node != NULL; current_node = current_node->next)
             {
-                level = level->next;
-            } else if (level->price == price) {
-                break;
-            } else {
-                level = NULL;
-                break;
+                cross(book, current_node->order, order);
+                if (order->open == 0) return;
             }
         }
     } else {
-        level = FirstAskLevel;
-        while (level != NULL)
+        for (current_level = book->firstasklevel; current_level != NULL; current_level = current_level->next)
         {
-            if (level->price < price)
+            if (current_level->price > order->price && order->orderType != MARKET) return;
+
+            for (current_node = current_level->firstordernode; current_node != NULL; current_node = current_node->next)
             {
-                level = level->next;
-            } else if (level->price == price) {
-                break;
-            } else {
-                level = NULL;
-                break;
+                cross(book, current_node->order, order);
+                if (order->open == 0) return;
             }
         }
     }
 
-    return level;
+    return;
 }
 
 
-ORDERNODE * find_ordernode (LEVEL * level, int id)
+void cleanup_closed_bids_or_asks (LEVEL ** root_level)  // root_level is pointing to firstbidlevel or firstasklevel, themselves pointers
 {
-    ORDERNODE * ordernode;
+    LEVEL * current_level;
+    LEVEL * old_level;
+    ORDERNODE * current_node;
+    ORDERNODE * old_node;
 
-    if (level)
+    if (*root_level == NULL) return;
+
+    current_level = *root_level;                        // Due to the double indirection, current_level still a pointer to a LEVEL
+    current_node = current_level->firstordernode;
+    assert(current_node != NULL);
+
+    while (1)
     {
-        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+        if (current_node->order->open)                  // We found the very first (highest priority) open order
         {
-            if (ordernode->order->id == id)
+            current_level->firstordernode = current_node;
+            current_level->prev = NULL;
+            current_node->prev = NULL;
+            *root_level = current_level;                // Remembering that current_level is a pointer, so
+            return;                                     // firstbidlevel or firstasklevel ends up pointing to the level
+        }
+
+        if (current_node->next != NULL)
+        {
+            old_node = current_node;
+            current_node = current_node->next;
+            free(old_node);
+        } else {
+            old_node = current_node;
+            old_level = current_level;
+            current_level = current_level->next;
+            free(old_node);
+            free(old_level);
+            if (current_level != NULL)
             {
-                return ordernode;
+                current_node = current_level->firstordernode;
+                assert(current_node != NULL);
+            } else {
+                *root_level = NULL;
+                return;
             }
         }
     }
 
-    return NULL;
+    return;
 }
 
 
-void cleanup_after_cancel (ORDERNODE * ordernode, LEVEL * level)       // Free the ordernode, maybe free the level, fix all links
+void insert_ask (BOOK * book, ORDER * order)
 {
-    int dir;
-
-    assert(ordernode && level);
-
-    dir = ordernode->order->direction;                  // Needed later
+    ORDERNODE * ordernode;
+    ORDERNODE * current_node;
+    LEVEL * prev_level = NULL;
+    LEVEL * level;
+    LEVEL * newlevel;
 
+    ordernode = init_ordernode(book, order, NULL, NULL);      // Fix ->prev later
 
-    if (ordernode->prev)
+    if (book->firstasklevel == NULL)
     {
-        ordernode->prev->next = ordernode->next;
+        book->firstasklevel = init_level(book, order->price, ordernode, NULL, NULL);
+        return;
     } else {
-        level->firstordernode = ordernode->next;        // Can set level->firstordernode to NULL, in which case
-    }                                                   // the level is now empty and must be destroyed in a bit
-
-    if (ordernode->next)
-    {
-        ordernode->next->prev = ordernode->prev;
+        level = book->firstasklevel;
     }
 
-    free(ordernode);
-
-    if (level->firstordernode == NULL)
+    while (1)
     {
-        if (level->prev)
+        if (order->price < level->price)
         {
-            level->prev->next = level->next;
-        } else {
-            if (dir == BUY)
+            // Create new level...
+
+            newlevel = init_level(book, order->price, ordernode, prev_level, level);
+            level->prev = newlevel;
+            if (prev_level)
             {
-                FirstBidLevel = level->next;
+                prev_level->next = newlevel;
             } else {
-                FirstAskLevel = level->next;
+                book->firstasklevel = newlevel;
             }
-        }
+            return;
 
-        if (level->next)
-        {
-            level->next->prev = level->prev;
-        }
+        } else if (order->price == level->price) {
 
-        free(level);
-    }
+            break;
+
+        } else {
+
+            // Iterate...
+
+            prev_level = level;
+            if (level->next != NULL)
+            {
+                level = level->next;
+            } else {
+                level->next = init_level(book, order->price, ordernode, prev_level, NULL);
+                return;
+            }
+        }
+    }
+
+    // So we should be on the right level now
+
+    assert(level->price == order->price);
+
+    current_node = level->firstordernode;
+    assert(current_node != NULL);
+
+    while (current_node->next != NULL)
+    {
+        current_node = current_node->next;
+    }
+
+    current_node->next = ordernode;
+    ordernode->prev = current_node;
+
+    return;
+}
+
+
+void insert_bid (BOOK * book, ORDER * order)
+{
+    ORDERNODE * ordernode;
+    ORDERNODE * current_node;
+    LEVEL * prev_level = NULL;
+    LEVEL * level;
+    LEVEL * newlevel;
+
+    ordernode = init_ordernode(book, order, NULL, NULL);      // Fix ->prev later
+
+    if (book->firstbidlevel == NULL)
+    {
+        book->firstbidlevel = init_level(book, order->price, ordernode, NULL, NULL);
+        return;
+    } else {
+        level = book->firstbidlevel;
+    }
+
+    while (1)
+    {
+        if (order->price > level->price)
+        {
+            // Create new level...
+
+            newlevel = init_level(book, order->price, ordernode, prev_level, level);
+            level->prev = newlevel;
+            if (prev_level)
+            {
+                prev_level->next = newlevel;
+            } else {
+                book->firstbidlevel = newlevel;
+            }
+            return;
+
+        } else if (order->price == level->price) {
+
+            break;
+
+        } else {
+
+            // Iterate...
+
+            prev_level = level;
+            if (level->next != NULL)
+            {
+                level = level->next;
+            } else {
+                level->next = init_level(book, order->price, ordernode, prev_level, NULL);
+                return;
+            }
+        }
+    }
+
+    // So we should be on the right level now
+
+    assert(level->price == order->price);
+
+    current_node = level->firstordernode;
+    assert(current_node != NULL);
+
+    while (current_node->next != NULL)
+    {
+        current_node = current_node->next;
+    }
+
+    current_node->next = ordernode;
+    ordernode->prev = current_node;
+
+    return;
+}
+
+
+int fok_can_buy (BOOK * book, int qty, int price)
+{
+    // Must use subtraction only. Adding could overflow.
+
+    LEVEL * level;
+    ORDERNODE * ordernode;
+
+    for (level = book->firstasklevel; level != NULL && level->price <= price; level = level->next)
+    {
+        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+        {
+            qty -= ordernode->order->qty;
+            if (qty <= 0) return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+int fok_can_sell (BOOK * book, int qty, int price)
+{
+    // Must use subtraction only. Adding could overflow.
+
+    LEVEL * level;
+    ORDERNODE * ordernode;
+
+    for (level = book->firstbidlevel; level != NULL && level->price >= price; level = level->next)
+    {
+        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+        {
+            qty -= ordernode->order->qty;
+            if (qty <= 0) return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+ACCOUNT * init_account (BOOK * book, char * name, int account_int)
+{
+    ACCOUNT * ret;
+
+    book->debuginfo.inits_of_account++;
+
+    ret = malloc(sizeof(ACCOUNT));
+    check_ptr_or_quit(ret);
+
+    ret->id = account_int;
+    safe_strcpy(ret->name, name, SMALLSTRING);
+
+    ret->orders = NULL;
+    ret->arraylen = 0;
+    ret->count = 0;
+
+    ret->posmin = 0;
+    ret->posmax = 0;
+    ret->shares = 0;
+    ret->cents = 0;
+
+    return ret;
+}
+
+
+void grow_account_storage (BOOK * book, int account_int)
+{
+    int n;
+
+    while (account_int >= book->accountarraylen)
+    {
+        book->allaccounts = realloc(book->allaccounts, (book->accountarraylen + 64) * sizeof(ACCOUNT *));
+        check_ptr_or_quit(book->allaccounts);
+        book->accountarraylen += 64;
+
+        // We must NULLify our new account pointers because there can be holes in the known
+        // account IDs: e.g. known IDs are 0,1,2,3,7. So, if we're asked to lookup ID 5, we
+        // need a way to know it doesn't exist...
+
+        for (n = book->accountarraylen - 64; n < book->accountarraylen; n++)
+        {
+            book->allaccounts[n] = NULL;
+        }
+
+        book->debuginfo.reallocs_of_global_account_list++;
+    }
+
+    return;
+}
+
+
+ACCOUNT * account_lookup_or_create (BOOK * book, char * account_name, int account_int)
+{
+    // If account_id is too high, we will need more storage...
+
+    grow_account_storage(book, account_int);
+
+    // If the account corresponsing to the account_id is NULL, create it...
+
+    if (book->allaccounts[account_int] == NULL)
+    {
+        book->allaccounts[account_int] = init_account(book, account_name, account_int);
+    }
+
+    // Done...
+
+    return book->allaccounts[account_int];
+}
+
+
+void add_order_to_account (BOOK * book, ORDER * order, ACCOUNT * accountobject)
+{
+    if (accountobject->count == accountobject->arraylen)
+    {
+        accountobject->orders = realloc(accountobject->orders, (accountobject->arraylen + 256) * sizeof(ORDER *));
+        check_ptr_or_quit(accountobject->orders);
+        accountobject->arraylen += 256;
+
+        book->debuginfo.reallocs_of_account_order_list++;
+    }
+    accountobject->orders[accountobject->count] = order;
+    accountobject->count += 1;
+
+    return;
+}
+
+
+ORDER_AND_ERROR * execute_order (BOOK * book, char * account_name, int account_int, int qty, int price, int direction, int orderType)
+{
+    // Note: account_name will be in the stack of the calling function, not in the heap
+
+    ORDER * order;
+    ORDER_AND_ERROR * o_and_e;
+    int id;
+    ACCOUNT * accountobject;
+
+    // The o_and_e structure lets us send either an order or an error to the caller...
+
+    o_and_e = init_o_and_e();
+
+    // Check for too high an order ID, too high an account ID, or silly values...
+
+    if (next_id(book, 1) >= MAXORDERS)                // Pass the no-iterate flag to next_id() here
+    {                                           // i.e. don't iterate until we know order succeeds
+        o_and_e->error = TOO_MANY_ORDERS;
+        return o_and_e;
+
+    } else if (account_int >= MAXACCOUNTS)
+    {
+        o_and_e->error = TOO_HIGH_ACCOUNT;
+        return o_and_e;
+
+    } else if (price < 0 || qty < 1 || (direction != SELL && direction != BUY))
+    {
+        o_and_e->error = SILLY_VALUE;
+        return o_and_e;
+    }
+
+    // The following call gets the account object. If not already extant, it is created.
+    // If more memory is needed to store accounts up to this account_id, that happens...
+
+    accountobject = account_lookup_or_create(book, account_name, account_int);
+
+    // Create order struct, and store a pointer to it in the account...
+
+    id = next_id(book, 0);
+    order = init_order(book, accountobject, qty, price, direction, orderType, id);
+    add_order_to_account(book, order, accountobject);
+    announce_order(book, order);
+
+    // Run the order, with checks for FOK if needed...
+
+    if (order->orderType != FOK)
+    {
+        run_order(book, order);
+    } else {
+        if (order->direction == BUY)
+        {
+            if (fok_can_buy(book, order->qty, order->price))
+            {
+                run_order(book, order);
+            }
+        } else {
+            if (fok_can_sell(book, order->qty, order->price))
+            {
+                run_order(book, order);
+            }
+        }
+    }
+
+    // Iterate through the Bids or Asks as appropriate, removing them from the book if they are now closed...
+
+    if (order->direction == SELL)
+    {
+        cleanup_closed_bids_or_asks(&book->firstbidlevel);
+    } else {
+        cleanup_closed_bids_or_asks(&book->firstasklevel);
+    }
+
+    // Market orders get set to price == 0 in official for storage / reporting
+    // (the timing doesn't matter, this could be done before running the order)
+
+    if (order->orderType == MARKET) order->price = 0;
+
+    // Place open limit orders on the book. Mark other order types as closed...
+
+    if (order->open)
+    {
+        if (order->orderType == LIMIT)
+        {
+            if (order->direction == SELL)
+            {
+                insert_ask(book, order);
+            } else {
+                insert_bid(book, order);
+            }
+            touch_level(book, order->direction, order->price);
+            touch_order(book, order);
+        } else {
+            order->open = 0;
+            order->qty = 0;
+            announce_closed(book, order, EVENT_CLOSED);
+        }
+    }
+
+    // If something happened, fix the quote and tell the frontend about it.
+    // The definition of "something happened" is anything that changes the book:
+    //      - a limit order was placed, OR
+    //      - fills were generated
+    // Nothing else changes the book except cancels, which we aren't dealing with here.
+
+    if (order->totalFilled || order->orderType == LIMIT)
+    {
+        remake_most_of_quote(book);     // the "last trade" parts are done by cross()
+        book->version++;
+        announce_levels(book);
+        announce_resting_orders(book);
+        announce_quote(book);
+    }
+
+    o_and_e->order = order;
+    return o_and_e;
+}
+
+
+ORDERNODE * find_ordernode (LEVEL * level, int id)
+{
+    ORDERNODE * ordernode;
+
+    if (level)
+    {
+        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+        {
+            if (ordernode->order->id == id)
+            {
+                return ordernode;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+void cleanup_after_cancel (BOOK * book, ORDERNODE * ordernode, LEVEL * level)       // Free the ordernode, maybe free the level, fix all links
+{
+    int dir;
+
+    assert(ordernode && level);
+
+    dir = ordernode->order->direction;                  // Needed later
+
+
+    if (ordernode->prev)
+    {
+        ordernode->prev->next = ordernode->next;
+    } else {
+        level->firstordernode = ordernode->next;        // Can set level->firstordernode to NULL, in which case
+    }                                                   // the level is now empty and must be destroyed in a bit
+
+    if (ordernode->next)
+    {
+        ordernode->next->prev = ordernode->prev;
+    }
+
+    free(ordernode);
+
+    if (level->firstordernode == NULL)
+    {
+        if (level->prev)
+        {
+            level->prev->next = level->next;
+        } else {
+            if (dir == BUY)
+            {
+                book->firstbidlevel = level->next;
+            } else {
+                book->firstasklevel = level->next;
+            }
+        }
+
+        if (level->next)
+        {
+            level->next->prev = level->prev;
+        }
+
+        free(level);
+    }
+
+    return;
+}
+
+
+void print_orderbook_binary (BUFFER * buf, BOOK * book, int depth, int orders)
+{
+    /*
+    Strategy for binary printout of the orderbook. Qty is never 0, so 0 qty can be used as an in-channel flag.
+
+    Format then is:
+
+    all bids ... flag ... all asks ... flag
+    using 8 bytes per message (e.g. 1 order or 1 flag takes 8 bytes)
+
+    e.g for a book with 2 bids and 2 asks:
+
+    4bytes (qty)
+    4bytes (price)
+    4bytes (qty)
+    4bytes (price)
+    0x00000000 (zero qty: flag)
+    0x00000000 (for consistency, i.e. 8 bytes per message)
+    4bytes (qty)
+    4bytes (price)
+    4bytes (qty)
+    4bytes (price)
+    0x00000000 (zero qty: flag)
+    0x00000000 (for consistency, i.e. 8 bytes per message)
+
+    Since we must choose an endian system, we will choose BIG (go big endian or go home).
+
+    Only the first depth levels and orders orders of each side are sent (either
+    can be NO_LIMIT).
+    */
+
+    LEVEL * level;
+    ORDERNODE * ordernode;
+
+    int i;
+    int n;
+    int levels_sent;
+    int orders_sent;
+    uint32_t qty;       // the order qty and price are signed ints not exceeding 2^31-1
+    uint32_t price;     // but promotion to unsigned here seems perfectly fine
+
+    for (i = 0; i < 2; i++)
+    {
+        levels_sent = 0;
+        orders_sent = 0;
+
+        for (level = (i == 0 ? book->firstbidlevel : book->firstasklevel); level != NULL && (depth == NO_LIMIT || levels_sent < depth) && (orders == NO_LIMIT || orders_sent < orders); level = level->next)
+        {
+            levels_sent++;
+
+            for (ordernode = level->firstordernode; ordernode != NULL && (orders == NO_LIMIT || orders_sent < orders); ordernode = ordernode->next)
+            {
+                orders_sent++;
+
+                qty = (uint32_t) ordernode->order->qty;
+                buf_putc(buf, (qty & 0xFF000000) >> 24);
+                buf_putc(buf, (qty & 0x00FF0000) >> 16);
+                buf_putc(buf, (qty & 0x0000FF00) >>  8);
+                buf_putc(buf, (qty & 0x000000FF)      );
+
+                price = (uint32_t) ordernode->order->price;
+                buf_putc(buf, (price & 0xFF000000) >> 24);
+                buf_putc(buf, (price & 0x00FF0000) >> 16);
+                buf_putc(buf, (price & 0x0000FF00) >>  8);
+                buf_putc(buf, (price & 0x000000FF)      );
+            }
+        }
+
+        for (n = 0; n < 8; n++)
+        {
+            buf_putc(buf, '\0');
+        }
+    }
+
+    return;
+}
+
+
+void print_levels_binary (BUFFER * buf, BOOK * book, int depth)
+{
+    /*
+    As print_orderbook_binary(), but each record is a whole price level, 16 bytes:
+
+    8bytes (total qty of the level)
+    4bytes (price)
+    4bytes (number of orders)
+
+    and a record of all zeros ends each side. At most depth levels are sent
+    per side, unless depth is NO_LIMIT.
+    */
+
+    LEVEL * level;
+
+    int i;
+    int n;
+
+    for (i = 0; i < 2; i++)
+    {
+        n = 0;
+
+        for (level = (i == 0 ? book->firstbidlevel : book->firstasklevel); level != NULL && (depth == NO_LIMIT || n < depth); level = level->next)
+        {
+            buf_put64(buf, (uint64_t) get_size_from_level(level));
+            buf_put32(buf, (uint32_t) level->price);
+            buf_put32(buf, (uint32_t) count_orders_in_level(level));
+            n++;
+        }
+
+        for (n = 0; n < 16; n++)
+        {
+            buf_putc(buf, '\0');
+        }
+    }
+
+    return;
+}
+
+
+int option_value (char tokens[MAXTOKENS][SMALLSTRING], int first, char * name, int default_value)
+{
+    // Looks for a token name=<n> (n not negative) from tokens[first] onwards.
+
+    size_t len;
+    int n;
+
+    len = strlen(name);
+
+    for (n = first; n < MAXTOKENS && tokens[n][0] != '\0'; n++)
+    {
+        if (strncmp(tokens[n], name, len) == 0 && tokens[n][len] == '=' && atoi(tokens[n] + len + 1) >= 0)
+        {
+            return atoi(tokens[n] + len + 1);
+        }
+    }
+
+    return default_value;
+}
+
+
+void print_all_orders_of_account (BUFFER * buf, BOOK * book, ACCOUNT * account, char tokens[MAXTOKENS][SMALLSTRING], int first)
+{
+    // The options (see STATUSALL above) are in tokens[first] onwards.
+
+    int flag;
+    int start;
+    int end;
+    int after;
+    int offset;
+    int limit;
+    int low;
+    int high;
+    int mid;
+    int n;
+
+    assert(account);
+
+    limit = option_value(tokens, first, "limit", NO_LIMIT);
+    after = option_value(tokens, first, "after", -1);
+
+    // The account's orders are in id order, so we can find the cursor quickly...
+
+    low = 0;
+    high = account->count;
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+        if (account->orders[mid]->id <= after)
+        {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    offset = option_value(tokens, first, "offset", 0);
+    start = offset < account->count - low ? low + offset : account->count;
+
+    end = account->count;
+    if (limit != NO_LIMIT && limit < end - start) end = start + limit;
+
+    buf_printf(buf, "{\"ok\": true, \"venue\": \"%s\", \"orders\": [", book->venue);
+
+    flag = 0;
+    for (n = start; n < end; n++)
+    {
+        if (flag) buf_printf(buf, ", \n");
+        print_order(buf, book, account->orders[n], option_value(tokens, first, "fills_offset", 0), option_value(tokens, first, "fills_limit", NO_LIMIT));
+        flag = 1;
+    }
+
+    buf_printf(buf, "]");
+
+    if (limit != NO_LIMIT)
+    {
+        buf_printf(buf, ", \"more\": %s", end < account->count ? "true" : "false");
+    }
+
+    buf_printf(buf, "}");
+
+    return;
+}
+
+
+int owner_in_list (ORDER * order, char tokens[MAXTOKENS][SMALLSTRING], int first)
+{
+    // For STATUS and CANCEL: any tokens from tokens[first] onwards are account names
+    // (apart from options, which contain '='), one of which must own the order. If
+    // there are no such tokens, anyone may see it.
+
+    int accounts;
+    int n;
+
+    accounts = 0;
+
+    for (n = first; n < MAXTOKENS && tokens[n][0] != '\0'; n++)
+    {
+        if (strchr(tokens[n], '=')) continue;
+        if (strcmp(order->account->name, tokens[n]) == 0) return 1;
+        accounts++;
+    }
+
+    return accounts == 0;
+}
+
+
+void cancel_order_by_id (BOOK * book, int id)
+{
+    ORDERNODE * ordernode;
+    int price;
+    int dir;
+    LEVEL * level;
+
+    assert(id >= 0 && id <= book->highestknownorder);
+
+    if (book->allorders[id]->orderType != LIMIT)    // Everything else is auto-cancelled after running
+    {
+        return;
+    }
+
+    price = book->allorders[id]->price;
+    dir = book->allorders[id]->direction;
+
+    // Find the level then the ordernode, if possible...
+
+    level = find_level(book, price, dir);
+    ordernode = find_ordernode(level, id);          // This is safe even if level == NULL
+
+    // Now close the order and do the linked-list fiddling...
+
+    if (ordernode)
+    {
+        ordernode->order->open = 0;
+        ordernode->order->qty = 0;
+        announce_closed(book, ordernode->order, EVENT_CANCEL);
+        touch_order(book, ordernode->order);
+
+        cleanup_after_cancel(book, ordernode, level);     // Frees the node and even the level if needed; fixes links
+        touch_level(book, dir, price);
+
+        remake_most_of_quote(book);                     // Remakes all but the "last trade" info in the quote
+        book->version++;
+        announce_levels(book);
+        announce_resting_orders(book);
+        announce_quote(book);
+    }
+
+    return;
+}
+
+
+void print_scores (BUFFER * buf, BOOK * book)
+{
+    ACCOUNT * account;
+    int64_t nav64;
+    char * ts;
+    int n;
+
+    buf_printf(buf, "<html><head><title>%s %s</title></head><body><pre>%s %s\n", book->venue, book->symbol, book->venue, book->symbol);
+
+    if (book->quote.last == -1)
+    {
+        buf_printf(buf, "No trading activity yet.</pre>");
+        return;
+    }
+
+    buf_printf(buf, "Current price: $%d.%02d\n\n", book->quote.last / 100, book->quote.last % 100);
+
+    buf_printf(buf, "             Account           USD $          Shares         Pos.min         Pos.max           NAV $\n");
+
+    for (n = 0; n < book->accountarraylen; n++)
+    {
+        if (book->allaccounts[n])
+        {
+            account = book->allaccounts[n];
+
+            // The values account->shares and account->cents are both int32, as is quote.last, so
+            // account->shares * quote.last + account->cents is guaranteed to fit in an int64.
+
+            nav64 = (int64_t) account->shares * (int64_t) book->quote.last + (int64_t) account->cents;
+
+            buf_printf(buf, "%20s %15d %15d %15d %15d %15" PRId64 "\n",
+                    account->name, account->cents / 100, account->shares, account->posmin, account->posmax, nav64 / 100);
+        }
+    }
+
+    ts = new_timestamp(book);
+    buf_printf(buf, "\n  Start time: %s\nCurrent time: %s", book->starttime, ts);
+    free(ts);
+
+    buf_printf(buf, "</pre></body></html>");
+
+    return;
+}
+
+
+void print_timestamp (BUFFER * buf, BOOK * book)
+{
+    char * ts;
+    ts = new_timestamp(book);
+    buf_printf(buf, "%s", ts);
+    free(ts);
+    return;
+}
+
+
+// ---------------------------------- SHARED MEMORY TRANSPORT -------------------------------
+//
+// Layout of the shared file (the frontend creates it and must agree with all of this):
+//
+//      SHM_HEADER, then SHM_RINGS times: SHM_RING followed by header.ringsize bytes of data
+//
+// Each ring has exactly one writer and one reader. head and tail only ever increase; the
+// writer owns head, the reader owns tail. A side that finds nothing to do spins for a while,
+// then announces it is waiting and sleeps on a futex which the other side bumps and wakes.
+
+
+#if defined(__linux__)
+
+#define SHM_MAGIC 0x64425253        // "dBRS"
+#define SHM_RINGS 3
+#define SHM_SPIN 4000
+
+#define SHM_COMMANDS 0
+#define SHM_REPLIES 1
+#define SHM_WEBSOCKET 2
+
+typedef struct ShmHeader_struct {
+    uint32_t magic;
+    uint32_t rings;
+    uint64_t ringsize;              // Bytes of data per ring (a power of 2)
+    char pad[48];
+} SHM_HEADER;
+
+typedef struct ShmRing_struct {     // Fields are on separate cache lines so the two sides don't fight
+    uint64_t head;                  // Total bytes ever written
+    char pad1[56];
+    uint64_t tail;                  // Total bytes ever read
+    char pad2[56];
+    uint32_t data_seq;              // Futex word the reader sleeps on
+    uint32_t reader_waiting;
+    char pad3[56];
+    uint32_t space_seq;             // Futex word the writer sleeps on
+    uint32_t writer_waiting;
+    char pad4[56];
+} SHM_RING;
+
+uint64_t ShmRingSize = 0;
+
+
+void shm_sleep (SHM_RING * ring, uint32_t * seq, uint32_t * waiting, uint64_t blocked_used)
+{
+    // Wait while the ring holds exactly blocked_used bytes (0 for the reader, ShmRingSize for the writer).
+    // Either way it's the other side that will change this.
+
+    uint32_t seqval;
+    int n;
+
+    for (n = 0; n < SHM_SPIN; n++)
+    {
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != blocked_used) return;
+        #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+        #endif
+    }
+
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    seqval = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == blocked_used)
+    {
+        syscall(SYS_futex, seq, FUTEX_WAIT, seqval, NULL, NULL, 0);     // Returns at once if seq already moved on
+    }
+
+    __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+    return;
+}
+
+
+void shm_wake (uint32_t * seq, uint32_t * waiting)
+{
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+    {
+        __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    return;
+}
+
+
+ssize_t shm_cookie_read (void * cookie, char * buf, size_t size)
+{
+    SHM_RING * ring;
+    char * data;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t offset;
+    size_t n;
+
+    ring = (SHM_RING *) cookie;
+    data = (char *) (ring + 1);
+
+    tail = ring->tail;
+
+    while ((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == tail)
+    {
+        shm_sleep(ring, &ring->data_seq, &ring->reader_waiting, 0);
+    }
+
+    offset = tail & (ShmRingSize - 1);
+
+    n = head - tail;
+    if (n > size) n = size;
+    if (n > ShmRingSize - offset) n = ShmRingSize - offset;        // Don't wrap; caller will come back for more
+
+    memcpy(buf, data + offset, n);
+
+    __atomic_store_n(&ring->tail, tail + n, __ATOMIC_SEQ_CST);
+    shm_wake(&ring->space_seq, &ring->writer_waiting);
+
+    return n;
+}
+
+
+ssize_t shm_cookie_write (void * cookie, const char * buf, size_t size)
+{
+    SHM_RING * ring;
+    char * data;
+    uint64_t head;
+    uint64_t offset;
+    size_t done;
+    size_t n;
+
+    ring = (SHM_RING *) cookie;
+    data = (char *) (ring + 1);
+
+    head = ring->head;
+
+    for (done = 0; done < size; done += n)
+    {
+        while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ShmRingSize)
+        {
+            shm_sleep(ring, &ring->space_seq, &ring->writer_waiting, ShmRingSize);
+        }
+
+        offset = head & (ShmRingSize - 1);
+
+        n = ShmRingSize - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+        if (n > size - done) n = size - done;
+        if (n > ShmRingSize - offset) n = ShmRingSize - offset;
+
+        memcpy(data + offset, buf + done, n);
+
+        head += n;
+        __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+        shm_wake(&ring->data_seq, &ring->reader_waiting);
+    }
+
+    return size;
+}
+
+
+int shm_setup (void)        // Returns 0 on success. On failure, the frontend will notice soon enough.
+{
+    struct stat st;
+    char * base;
+    SHM_HEADER * header;
+    SHM_RING * rings[SHM_RINGS];
+    cookie_io_functions_t reader_functions = {shm_cookie_read, NULL, NULL, NULL};
+    cookie_io_functions_t writer_functions = {NULL, shm_cookie_write, NULL, NULL};
+    int n;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);       // We'll never see EOF, so this is how we die with the frontend
+
+    if (fstat(3, &st) != 0 || (size_t) st.st_size < sizeof(SHM_HEADER))
+    {
+        return 1;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, 3, 0);
+    if (base == MAP_FAILED)
+    {
+        return 1;
+    }
+
+    header = (SHM_HEADER *) base;
+
+    if (header->magic != SHM_MAGIC || header->rings != SHM_RINGS || header->ringsize == 0 || (header->ringsize & (header->ringsize - 1)) ||
+        sizeof(SHM_HEADER) + SHM_RINGS * (sizeof(SHM_RING) + header->ringsize) > (size_t) st.st_size)
+    {
+        return 1;
+    }
+
+    ShmRingSize = header->ringsize;
+
+    for (n = 0; n < SHM_RINGS; n++)
+    {
+        rings[n] = (SHM_RING *) (base + sizeof(SHM_HEADER) + n * (sizeof(SHM_RING) + ShmRingSize));
+    }
+
+    // glibc lets us simply replace the standard streams; everything else keeps using printf() etc.
+
+    stdin = fopencookie(rings[SHM_COMMANDS], "r", reader_functions);
+    stdout = fopencookie(rings[SHM_REPLIES], "w", writer_functions);
+    stderr = fopencookie(rings[SHM_WEBSOCKET], "w", writer_functions);
+
+    if (stdin == NULL || stdout == NULL || stderr == NULL)
+    {
+        return 1;
+    }
+
+    setvbuf(stdout, NULL, _IOFBF, 65536);       // Flushed by send_reply()
+    setvbuf(stderr, NULL, _IOFBF, 65536);
+
+    return 0;
+}
+
+#else
+
+int shm_setup (void)
+{
+    return 1;
+}
+
+#endif
+
+
+// ------------------------------------------------------------------------------------------
+
+
+void print_memory_info (BUFFER * buf, BOOK * book)
+{
+    buf_printf(buf,
+            "DebugInfo.inits_of_level: %d,\n"               // The compiler auto-concatenates these things
+            "DebugInfo.inits_of_fill: %d,\n"                // (note the lack of commas)
+            "DebugInfo.inits_of_fillnode: %d,\n"
+            "DebugInfo.inits_of_order: %d,\n"
+            "DebugInfo.inits_of_ordernode: %d,\n"
+            "DebugInfo.inits_of_account: %d,\n"
+            "DebugInfo.reallocs_of_global_order_list: %d,\n"
+            "DebugInfo.reallocs_of_global_account_list: %d,\n"
+            "DebugInfo.reallocs_of_account_order_list: %d",
+            book->debuginfo.inits_of_level,
+            book->debuginfo.inits_of_fill,
+            book->debuginfo.inits_of_fillnode,
+            book->debuginfo.inits_of_order,
+            book->debuginfo.inits_of_ordernode,
+            book->debuginfo.inits_of_account,
+            book->debuginfo.reallocs_of_global_order_list,
+            book->debuginfo.reallocs_of_global_account_list,
+            book->debuginfo.reallocs_of_account_order_list
+            );
+    return;
+}
+
+
+BOOK * new_book (void)
+{
+    // Makes an empty, unnamed book. We also get some first-time allocation
+    // out of the way, since this is normally done while idle.
+
+    BOOK * ret;
+
+    ret = calloc(1, sizeof(BOOK));
+    check_ptr_or_quit(ret);
+
+    ret->highestknownorder = -1;
+
+    ret->quote.bid = -1;            // -1 used as a null value
+    ret->quote.ask = -1;
+    ret->quote.last = -1;
+    ret->quote.lastSize = -1;
+
+    grow_order_storage(ret, 0);
+    grow_account_storage(ret, 0);
+
+    return ret;
+}
+
+
+void name_book (BOOK * book, char * venue, char * symbol)
+{
+    safe_strcpy(book->venue, venue, SMALLSTRING);
+    safe_strcpy(book->symbol, symbol, SMALLSTRING);
+
+    book->starttime = new_timestamp(book);
+
+    safe_strcpy(book->quote.quoteTime, book->starttime, SMALLSTRING);
+    return;
+}
+
+
+SHARD * shard_of (int book_id)
+{
+    return &Shards[book_id >= 0 ? book_id % NumShards : 0];   // Bad ids go to shard 0, which will complain
+}
+
+
+BOOK * find_book (SHARD * shard, int book_id)
+{
+    int index;
+
+    if (book_id < 0) return NULL;
+
+    index = book_id / NumShards;
+    return index < shard->bookarraylen ? shard->books[index] : NULL;
+}
+
+
+BOOK * init_book (SHARD * shard, int book_id, char * venue, char * symbol)
+{
+    BOOK * book;
+    int index;
+    int n;
+
+    assert(book_id >= 0);
+
+    index = book_id / NumShards;
+
+    while (index >= shard->bookarraylen)
+    {
+        shard->books = realloc(shard->books, (shard->bookarraylen + 64) * sizeof(BOOK *));
+        check_ptr_or_quit(shard->books);
+        shard->bookarraylen += 64;
+
+        for (n = shard->bookarraylen - 64; n < shard->bookarraylen; n++)
+        {
+            shard->books[n] = NULL;
+        }
+    }
+
+    if (shard->sparebook)
+    {
+        book = shard->sparebook;
+        shard->sparebook = NULL;
+    } else {
+        book = new_book();
+    }
+
+    name_book(book, venue, symbol);
+
+    book->id = book_id;
+    book->shard = shard;
+    shard->books[index] = book;
+    return book;
+}
+
+
+void tokenise (char * input, char tokens[MAXTOKENS][SMALLSTRING])
+{
+    char * tmp;
+    char * saveptr;
+    int n;
+
+    tmp = STRTOK(input, " \t\n\r", &saveptr);
+    for (n = 0; n < MAXTOKENS; n++)
+    {
+        tokens[n][0] = '\0';        // Clear the token in case there isn't one in this slot
+        if (tmp != NULL)
+        {
+            safe_strcpy(tokens[n], tmp, SMALLSTRING);
+            tmp = STRTOK(NULL, " \t\n\r", &saveptr);
+        }
+    }
+    return;
+}
+
+
+void book_command (BOOK * book, char tokens[MAXTOKENS][SMALLSTRING])
+{
+    // Handles any command other than INIT, putting the reply in book->reply.
+
+    int id;
+    ORDER_AND_ERROR * o_and_e;
+    BUFFER * reply;
+
+    reply = &book->reply;
+
+    if (strcmp("ORDER", tokens[0]) == 0)
+    {
+        o_and_e = execute_order(book, tokens[1], atoi(tokens[2]), atoi(tokens[3]), atoi(tokens[4]), atoi(tokens[5]), atoi(tokens[6]));
+        //                            account    account_int      qty              price            direction        orderType
+
+        if (o_and_e->error)
+        {
+            buf_printf(reply, "{\"ok\": false, \"error\": \"Backend error %d (account = %s, account_int = %d, qty = %d, price = %d, direction = %d, orderType = %d)\"}",
+                o_and_e->error, tokens[1], atoi(tokens[2]), atoi(tokens[3]), atoi(tokens[4]), atoi(tokens[5]), atoi(tokens[6]));
+        } else {
+            print_order(reply, book, o_and_e->order, 0, NO_LIMIT);
+        }
+        free(o_and_e);
+
+        return;
+    }
+
+    if (strcmp("ORDERBOOK_BINARY", tokens[0]) == 0)
+    {
+        print_orderbook_binary(reply, book, option_value(tokens, 1, "depth", NO_LIMIT), option_value(tokens, 1, "orders", NO_LIMIT));
+        return;
+    }
+
+    if (strcmp("LEVELS_BINARY", tokens[0]) == 0)
+    {
+        print_levels_binary(reply, book, option_value(tokens, 1, "depth", NO_LIMIT));
+        return;
+    }
+
+    if (strcmp("STATUS", tokens[0]) == 0)
+    {
+        id = atoi(tokens[1]);
+
+        if (id < 0 || id > book->highestknownorder || book->allorders[id] == NULL)
+        {
+            buf_printf(reply, "{\"ok\": false, \"error\": \"Unknown order ID\"}");
+        } else if (owner_in_list(book->allorders[id], tokens, 2) == 0) {
+            buf_printf(reply, "{\"ok\": false, \"error\": \"Unknown account or wrong API key\"}");
+        } else {
+            print_order(reply, book, book->allorders[id], option_value(tokens, 2, "fills_offset", 0), option_value(tokens, 2, "fills_limit", NO_LIMIT));
+        }
+
+        return;
+    }
+
+    if (strcmp("STATUSALL", tokens[0]) == 0)
+    {
+        // This can return a stupid amount of data. Frontend might want to not honour requests for this.
+
+        id = atoi(tokens[1]);       // id is an account id in this case
+
+        if (id < 0 || id >= book->accountarraylen || book->allaccounts[id] == NULL)     // The order matters here (short-circuit)
+        {
+            buf_printf(reply, "{\"ok\": false, \"error\": \"Account not known on this book\"}");
+        } else {
+            print_all_orders_of_account(reply, book, book->allaccounts[id], tokens, 2);
+        }
+
+        return;
+    }
+
+    if (strcmp("CANCEL", tokens[0]) == 0)
+    {
+        id = atoi(tokens[1]);
+
+        if (id < 0 || id > book->highestknownorder || book->allorders[id] == NULL)
+        {
+            buf_printf(reply, "{\"ok\": false, \"error\": \"Unknown order ID\"}");
+        } else if (owner_in_list(book->allorders[id], tokens, 2) == 0) {
+            buf_printf(reply, "{\"ok\": false, \"error\": \"Unknown account or wrong API key\"}");
+        } else {
+            cancel_order_by_id(book, id);
+            print_order(reply, book, book->allorders[id], 0, NO_LIMIT);
+        }
+
+        return;
+    }
+
+    if (strcmp("QUOTE", tokens[0]) == 0)
+    {
+        print_quote(reply, book, &book->quote);
+        return;
+    }
+
+    if (strcmp("SUBSCRIBE", tokens[0]) == 0)
+    {
+        if (strcmp("TICKER", tokens[1]) == 0)
+        {
+            book->wantticker = atoi(tokens[2]) ? 1 : 0;
+        } else if (strcmp("EXECUTIONS", tokens[1]) == 0) {
+            watch_account(book, atoi(tokens[2]), atoi(tokens[3]));
+        } else if (strcmp("DEPTH", tokens[1]) == 0) {
+            watch_depth(book, atoi(tokens[2]));
+        } else if (strcmp("BOOK", tokens[1]) == 0) {
+            watch_book(book, atoi(tokens[2]));
+        } else {
+            buf_printf(reply, "{\"ok\": false, \"error\": \"Unknown subscription\"}");
+            return;
+        }
+
+        buf_printf(reply, "{\"ok\": true}");
+        return;
+    }
+
+    if (strcmp("__ACC_FROM_ID__", tokens[0]) == 0)
+    {
+        id = atoi(tokens[1]);
+
+        if (id < 0 || id > book->highestknownorder || book->allorders[id] == NULL)
+        {
+            buf_printf(reply, "ERROR None");
+        } else {
+            buf_printf(reply, "OK %s", book->allorders[id]->account->name);
+        }
+
+        return;
+    }
+
+    if (strcmp("__DEBUG_MEMORY__", tokens[0]) == 0)
+    {
+        print_memory_info(reply, book);
+        return;
+    }
+
+    if (strcmp("__TIMESTAMP__", tokens[0]) == 0)
+    {
+        print_timestamp(reply, book);
+        return;
+    }
+
+    if (strcmp("__SCORES__", tokens[0]) == 0)
+    {
+        print_scores(reply, book);
+        return;
+    }
+
+    buf_printf(reply, "{\"ok\": false, \"error\": \"Did not comprehend\"}");
+    return;
+}
+
+
+void handle_command (SHARD * shard, char * input)
+{
+    char * rest;
+    char tokens[MAXTOKENS][SMALLSTRING];
+    int book_id;
+    BOOK * book;
+    BUFFER * reply;
+
+    reply = &shard->reply;
+
+    book_id = (int) strtol(input, &rest, 10);
+
+    tokenise(rest, tokens);
+
+    if (rest == input || book_id < 0)
+    {
+        buf_printf(reply, "{\"ok\": false, \"error\": \"Command lacked a book number\"}");
+        send_reply(reply, -1, 0);
+        return;
+    }
+
+    book = find_book(shard, book_id);
+
+    if (strcmp("INIT", tokens[0]) == 0)
+    {
+        if (book != NULL)
+        {
+            buf_printf(reply, "{\"ok\": false, \"error\": \"Book %d already initialised as %s %s\"}", book_id, book->venue, book->symbol);
+            send_reply(reply, book_id, 0);
+        } else if (tokens[1][0] == '\0' || tokens[2][0] == '\0') {
+            buf_printf(reply, "{\"ok\": false, \"error\": \"INIT needs a venue and symbol\"}");
+            send_reply(reply, book_id, 0);
+        } else {
+            init_book(shard, book_id, tokens[1], tokens[2]);
+            buf_printf(reply, "{\"ok\": true}");
+            send_reply(reply, book_id, 0);
+            shard->sparebook = new_book();     // After replying, so this isn't on the critical path
+        }
+        return;
+    }
+
+    if (book == NULL)
+    {
+        buf_printf(reply, "{\"ok\": false, \"error\": \"Book %d not initialised (use INIT)\"}", book_id);
+        send_reply(reply, book_id, 0);
+        return;
+    }
+
+    book_command(book, tokens);
+    send_reply(&book->reply, book_id, book->version);
+    return;
+}
+
+
+// ---------------------------------- LIBRARY API -------------------------------------------
+//
+// See disorderBook.h. These are thread-safe as long as no book is used by
+// two threads at once, since books share nothing.
+
+
+DB_BOOK * db_new_book (char * venue, char * symbol)
+{
+    BOOK * book;
+
+    book = new_book();
+    name_book(book, venue, symbol);
+    return book;
+}
+
+
+char * db_command (DB_BOOK * book, char * command, size_t * reply_len)
+{
+    char input[MAXSTRING];
+    char tokens[MAXTOKENS][SMALLSTRING];
+
+    book->reply.len = 0;
+    book->wsmessage.len = 0;
+
+    safe_strcpy(input, command, MAXSTRING);
+    tokenise(input, tokens);
+
+    if (strcmp("INIT", tokens[0]) == 0)
+    {
+        buf_printf(&book->reply, "{\"ok\": false, \"error\": \"Book already initialised as %s %s\"}", book->venue, book->symbol);
+    } else {
+        book_command(book, tokens);
+    }
+
+    if (book->reply.data == NULL) buf_grow(&book->reply, 0);       // So we never return NULL
 
-    return;
+    *reply_len = book->reply.len;
+    return book->reply.data;
 }
 
 
-void print_orderbook_binary (void)
+char * db_submit (DB_BOOK * book, char * account, int account_int, int qty, int price, int direction, int orderType, size_t * reply_len)
 {
-    /*
-    Strategy for binary printout of the orderbook. Qty is never 0, so 0 qty can be used as an in-channel flag.
-
-    Format then is:
+    char command[MAXSTRING];
 
-    all bids ... flag ... all asks ... flag
-    using 8 bytes per message (e.g. 1 order or 1 flag takes 8 bytes)
+    snprintf(command, MAXSTRING, "ORDER %s %d %d %d %d %d", account, account_int, qty, price, direction, orderType);
+    return db_command(book, command, reply_len);
+}
 
-    e.g for a book with 2 bids and 2 asks:
 
-    4bytes (qty)
-    4bytes (price)
-    4bytes (qty)
-    4bytes (price)
-    0x00000000 (zero qty: flag)
-    0x00000000 (for consistency, i.e. 8 bytes per message)
-    4bytes (qty)
-    4bytes (price)
-    4bytes (qty)
-    4bytes (price)
-    0x00000000 (zero qty: flag)
-    0x00000000 (for consistency, i.e. 8 bytes per message)
+char * db_status (DB_BOOK * book, int id, char * account, size_t * reply_len)
+{
+    char command[MAXSTRING];
 
-    Since we must choose an endian system, we will choose BIG (go big endian or go home).
-    */
+    snprintf(command, MAXSTRING, "STATUS %d %s", id, account ? account : "");
+    return db_command(book, command, reply_len);
+}
 
-    LEVEL * level;
-    ORDERNODE * ordernode;
 
-    int i;
-    int n;
-    uint32_t qty;       // the order qty and price are signed ints not exceeding 2^31-1
-    uint32_t price;     // but promotion to unsigned here seems perfectly fine
+char * db_cancel (DB_BOOK * book, int id, char * account, size_t * reply_len)
+{
+    char command[MAXSTRING];
 
-    for (i = 0; i < 2; i++)
-    {
-        for (level = (i == 0 ? FirstBidLevel : FirstAskLevel); level != NULL; level = level->next)
-        {
-            for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
-            {
-                qty = (uint32_t) ordernode->order->qty;
-                putc((qty & 0xFF000000) >> 24, stdout);
-                putc((qty & 0x00FF0000) >> 16, stdout);
-                putc((qty & 0x0000FF00) >>  8, stdout);
-                putc((qty & 0x000000FF)      , stdout);
+    snprintf(command, MAXSTRING, "CANCEL %d %s", id, account ? account : "");
+    return db_command(book, command, reply_len);
+}
 
-                price = (uint32_t) ordernode->order->price;
-                putc((price & 0xFF000000) >> 24, stdout);
-                putc((price & 0x00FF0000) >> 16, stdout);
-                putc((price & 0x0000FF00) >>  8, stdout);
-                putc((price & 0x000000FF)      , stdout);
-            }
-        }
 
-        for (n = 0; n < 8; n++)
-        {
-            putc('\0', stdout);
-        }
-    }
+char * db_events (DB_BOOK * book, size_t * events_len)
+{
+    if (book->wsmessage.data == NULL) buf_grow(&book->wsmessage, 0);
 
-    return;
+    *events_len = book->wsmessage.len;
+    return book->wsmessage.data;
 }
 
 
-void print_all_orders_of_account (ACCOUNT * account)
+unsigned long long db_version (DB_BOOK * book)
 {
-    int flag;
-    int n;
+    return (unsigned long long) book->version;
+}
 
-    assert(account);
 
-    printf("{\"ok\": true, \"venue\": \"%s\", \"orders\": [", Venue);
+// ---------------------------------- MATCHING THREADS --------------------------------------
 
-    flag = 0;
-    for (n = 0; n < account->count; n++)
-    {
-        if (flag) printf(", \n");
-        print_order(stdout, account->orders[n]);
-        flag = 1;
-    }
 
-    printf("]}");
+void set_affinity (int cpu)         // For the calling thread
+{
+    #if defined(__linux__)
+        cpu_set_t set;
+
+        if (cpu < 0) return;
 
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);     // If it fails, we just run unpinned
+    #else
+        (void) cpu;
+    #endif
     return;
 }
 
 
-void cancel_order_by_id (int id)
+#if defined(USE_THREADS)
+
+void queue_init (COMMAND_QUEUE * queue)
 {
-    ORDERNODE * ordernode;
-    int price;
-    int dir;
-    LEVEL * level;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->consumer_waiting = 0;
 
-    assert(id >= 0 && id <= HighestKnownOrder);
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->cond, NULL);
 
-    if (AllOrders[id]->orderType != LIMIT)          // Everything else is auto-cancelled after running
-    {
-        return;
-    }
+    queue->slots = malloc(QUEUE_SLOTS * MAXSTRING);
+    check_ptr_or_quit(queue->slots);
 
-    price = AllOrders[id]->price;
-    dir = AllOrders[id]->direction;
+    return;
+}
 
-    // Find the level then the ordernode, if possible...
 
-    level = find_level(price, dir);
-    ordernode = find_ordernode(level, id);          // This is safe even if level == NULL
+void queue_push (COMMAND_QUEUE * queue, char * input)      // Main thread only
+{
+    uint64_t head;
 
-    // Now close the order and do the linked-list fiddling...
+    head = queue->head;
 
-    if (ordernode)
+    while (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == QUEUE_SLOTS)
     {
-        ordernode->order->open = 0;
-        ordernode->order->qty = 0;
+        sched_yield();              // Full. The matching thread is busy, so won't be long.
+    }
+
+    safe_strcpy(queue->slots[head & (QUEUE_SLOTS - 1)], input, MAXSTRING);
 
-        cleanup_after_cancel(ordernode, level);     // Frees the node and even the level if needed; fixes links
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
 
-        remake_most_of_quote();                     // Remakes all but the "last trade" info in the quote
-        create_ticker_message();
+    if (__atomic_load_n(&queue->consumer_waiting, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&queue->mutex);
+        pthread_cond_signal(&queue->cond);
+        pthread_mutex_unlock(&queue->mutex);
     }
 
     return;
 }
 
 
-void print_scores (void)
+char * queue_peek (COMMAND_QUEUE * queue)       // Matching thread only. Returns the next command, leaving it in place.
 {
-    ACCOUNT * account;
-    int64_t nav64;
-    char * ts;
+    uint64_t tail;
     int n;
 
-    printf("<html><head><title>%s %s</title></head><body><pre>%s %s\n", Venue, Symbol, Venue, Symbol);
+    tail = queue->tail;
 
-    if (Quote.last == -1)
+    for (n = 0; n < QUEUE_SPIN; n++)
     {
-        printf("No trading activity yet.</pre>");
-        return;
+        if (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) != tail)
+        {
+            return queue->slots[tail & (QUEUE_SLOTS - 1)];
+        }
+        #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+        #endif
     }
 
-    printf("Current price: $%d.%02d\n\n", Quote.last / 100, Quote.last % 100);
-
-    printf("             Account           USD $          Shares         Pos.min         Pos.max           NAV $\n");
+    // Nothing for a while, so sleep until the main thread wakes us...
 
-    for (n = 0; n < CurrentAccountArrayLen; n++)
+    pthread_mutex_lock(&queue->mutex);
+    __atomic_store_n(&queue->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) == tail)
     {
-        if (AllAccounts[n])
-        {
-            account = AllAccounts[n];
-
-            // The values account->shares and account->cents are both int32, as is Quote.last, so
-            // account->shares * Quote.last + account->cents is guaranteed to fit in an int64.
-
-            nav64 = (int64_t) account->shares * (int64_t) Quote.last + (int64_t) account->cents;
-
-            printf("%20s %15d %15d %15d %15d %15" PRId64 "\n",
-                    account->name, account->cents / 100, account->shares, account->posmin, account->posmax, nav64 / 100);
-        }
+        pthread_cond_wait(&queue->cond, &queue->mutex);
     }
+    __atomic_store_n(&queue->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&queue->mutex);
 
-    ts = new_timestamp();
-    printf("\n  Start time: %s\nCurrent time: %s", StartTime, ts);
-    free(ts);
+    return queue->slots[tail & (QUEUE_SLOTS - 1)];
+}
 
-    printf("</pre></body></html>");
 
+void queue_pop (COMMAND_QUEUE * queue)          // Matching thread only. Frees the slot returned by queue_peek().
+{
+    __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
     return;
 }
 
 
-void print_timestamp (void)
+void * shard_thread (void * arg)
 {
-    char * ts;
-    ts = new_timestamp();
-    printf("%s", ts);
-    free(ts);
-    return;
+    SHARD * shard;
+    char * input;
+
+    shard = (SHARD *) arg;
+
+    set_affinity(shard->cpu);
+
+    shard->sparebook = new_book();
+
+    while (1)
+    {
+        input = queue_peek(&shard->queue);
+        handle_command(shard, input);
+        queue_pop(&shard->queue);
+    }
+
+    return NULL;
 }
 
 
-void print_memory_info (void)
+// ---------------------------------- EMITTER THREAD ----------------------------------------
+
+
+int emit_events (BUFFER * buf)
 {
-    printf( "DebugInfo.inits_of_level: %d,\n"               // The compiler auto-concatenates these things
-            "DebugInfo.inits_of_fill: %d,\n"                // (note the lack of commas)
-            "DebugInfo.inits_of_fillnode: %d,\n"
-            "DebugInfo.inits_of_order: %d,\n"
-            "DebugInfo.inits_of_ordernode: %d,\n"
-            "DebugInfo.inits_of_account: %d,\n"
-            "DebugInfo.reallocs_of_global_order_list: %d,\n"
-            "DebugInfo.reallocs_of_global_account_list: %d,\n"
-            "DebugInfo.reallocs_of_account_order_list: %d",
-            DebugInfo.inits_of_level,
-            DebugInfo.inits_of_fill,
-            DebugInfo.inits_of_fillnode,
-            DebugInfo.inits_of_order,
-            DebugInfo.inits_of_ordernode,
-            DebugInfo.inits_of_account,
-            DebugInfo.reallocs_of_global_order_list,
-            DebugInfo.reallocs_of_global_account_list,
-            DebugInfo.reallocs_of_account_order_list
-            );
-    return;
+    // Takes events from every matching thread's queue and serializes them into buf,
+    // which is written out whenever it gets big. Returns how many events there were.
+
+    EVENT_QUEUE * queue;
+    uint64_t tail;
+    int count;
+    int n;
+
+    count = 0;
+
+    for (n = 0; n < NumShards; n++)
+    {
+        queue = &Shards[n].events;
+        tail = queue->tail;
+
+        while (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) != tail)
+        {
+            serialize_event(buf, &queue->slots[tail & (EVENT_QUEUE_SLOTS - 1)]);
+            tail++;
+            __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+            count++;
+
+            if (buf->len >= EMITTER_BATCH) break;
+        }
+    }
+
+    if (buf->len > 0)
+    {
+        LOCK_STREAM(StderrMutex);
+        fwrite(buf->data, 1, buf->len, stderr);
+        fflush(stderr);
+        UNLOCK_STREAM(StderrMutex);
+        buf->len = 0;
+    }
+
+    return count;
 }
 
 
-int main (int argc, char ** argv)
+int events_pending (void)
 {
-    char * eofcheck;
-    char * tmp;
-    char input[MAXSTRING];
-    char tokens[MAXTOKENS][SMALLSTRING];
-    int id;
     int n;
-    ORDER_AND_ERROR * o_and_e;
 
-    if (argc != 3)
+    for (n = 0; n < NumShards; n++)
     {
-        printf("Backend called with %d arguments (2 required). Quitting.\n", argc - 1);
-        return 1;
+        if (__atomic_load_n(&Shards[n].events.head, __ATOMIC_SEQ_CST) != __atomic_load_n(&Shards[n].events.tail, __ATOMIC_SEQ_CST)) return 1;
     }
+    return 0;
+}
 
-    // On Windows, set stdout to not auto-convert \n into \r\n (messes with our binary orderbook)
-    #if defined(_WIN32)
-        _setmode(_fileno(stdout), _O_BINARY);
-    #endif
 
-    safe_strcpy(Venue, argv[1], SMALLSTRING);
-    safe_strcpy(Symbol, argv[2], SMALLSTRING);
+void * emitter_thread (void * arg)
+{
+    BUFFER buf = {NULL, 0, 0};
+    int idle;
 
-    StartTime = new_timestamp();
+    (void) arg;
 
-    safe_strcpy(Quote.quoteTime, StartTime, SMALLSTRING);
+    idle = 0;
 
     while (1)
     {
-        eofcheck = fgets(input, MAXSTRING, stdin);
-
-        if (eofcheck == NULL)           // i.e. we HAVE reached EOF
+        if (emit_events(&buf) > 0)
         {
-            printf("{\"ok\": false, \"error\": \"Unexpected EOF on stdin. Quitting.\"}");
-            end_message(stdout);
-            return 1;
+            idle = 0;
+            continue;
         }
 
-        tmp = strtok(input, " \t\n\r");
-        for (n = 0; n < MAXTOKENS; n++)
+        if (++idle < QUEUE_SPIN)
         {
-            tokens[n][0] = '\0';        // Clear the token in case there isn't one in this slot
-            if (tmp != NULL)
-            {
-                safe_strcpy(tokens[n], tmp, SMALLSTRING);
-                tmp = strtok(NULL, " \t\n\r");
-            }
+            #if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+            #endif
+            continue;
         }
 
-        // Now handle whatever the request was.........
+        // Nothing for a while, so sleep until a matching thread wakes us...
 
-        if (strcmp("ORDER", tokens[0]) == 0)
+        pthread_mutex_lock(&EmitterMutex);
+        __atomic_store_n(&EmitterWaiting, 1, __ATOMIC_SEQ_CST);
+        while (events_pending() == 0)
         {
-            o_and_e = execute_order(tokens[1], atoi(tokens[2]), atoi(tokens[3]), atoi(tokens[4]), atoi(tokens[5]), atoi(tokens[6]));
-            //                      account    account_int      qty              price            direction        orderType
+            pthread_cond_wait(&EmitterCond, &EmitterMutex);
+        }
+        __atomic_store_n(&EmitterWaiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&EmitterMutex);
 
-            if (o_and_e->error)
-            {
-                printf("{\"ok\": false, \"error\": \"Backend error %d (account = %s, account_int = %d, qty = %d, price = %d, direction = %d, orderType = %d)\"}",
-                    o_and_e->error, tokens[1], atoi(tokens[2]), atoi(tokens[3]), atoi(tokens[4]), atoi(tokens[5]), atoi(tokens[6]));
-            } else {
-                print_order(stdout, o_and_e->order);
-            }
-            free(o_and_e);
+        idle = 0;
+    }
 
-            end_message(stdout);
-            continue;
+    return NULL;
+}
+
+#endif
+
+
+int parse_cpu_list (char * list, int * cpus, int maxcpus)      // e.g. "0,2,4-7". Returns how many, or -1 on error.
+{
+    char * p;
+    char * end;
+    long first;
+    long last;
+    int count;
+
+    count = 0;
+    p = list;
+
+    while (*p)
+    {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0) return -1;
+        last = first;
+        p = end;
+
+        if (*p == '-')
+        {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return -1;
+            p = end;
         }
 
-        if (strcmp("ORDERBOOK_BINARY", tokens[0]) == 0)
+        for ( ; first <= last; first++)
         {
-            print_orderbook_binary();
-            fflush(stdout);             // no end_message() call for binary
-            continue;
+            if (count >= maxcpus) return -1;
+            cpus[count++] = (int) first;
         }
 
-        if (strcmp("STATUS", tokens[0]) == 0)
+        if (*p == ',')
         {
-            id = atoi(tokens[1]);
+            p++;
+        } else if (*p) {
+            return -1;
+        }
+    }
 
-            if (id < 0 || id > HighestKnownOrder || AllOrders[id] == NULL)
-            {
-                printf("{\"ok\": false, \"error\": \"No such ID\"}");
-            } else {
-                print_order(stdout, AllOrders[id]);
-            }
+    return count;
+}
 
-            end_message(stdout);
-            continue;
-        }
 
-        if (strcmp("STATUSALL", tokens[0]) == 0)
-        {
-            // This can return a stupid amount of data. Frontend might want to not honour requests for this.
+// ------------------------------------------------------------------------------------------
 
-            id = atoi(tokens[1]);       // id is an account id in this case
 
-            if (id < 0 || id >= CurrentAccountArrayLen || AllAccounts[id] == NULL)      // The order matters here (short-circuit)
-            {
-                printf("{\"ok\": false, \"error\": \"Account not known on this book\"}");
-            } else {
-                print_all_orders_of_account(AllAccounts[id]);
-            }
+#if !defined(DISORDERBOOK_LIBRARY)
 
-            end_message(stdout);
-            continue;
-        }
+int main (int argc, char ** argv)
+{
+    char * eofcheck;
+    char input[MAXSTRING];
+    char * names[2];
+    int cpus[1024];
+    int cpucount;
+    int namecount;
+    int threads;
+    int use_shm;
+    int n;
 
-        if (strcmp("CANCEL", tokens[0]) == 0)
-        {
-            id = atoi(tokens[1]);
+    #if defined(USE_THREADS)
+        pthread_t emitter;
+    #endif
 
-            if (id < 0 || id > HighestKnownOrder || AllOrders[id] == NULL)
+    use_shm = 0;
+    threads = 1;
+    cpucount = 0;
+    namecount = 0;
+
+    for (n = 1; n < argc; n++)
+    {
+        if (strcmp(argv[n], "-shm") == 0)
+        {
+            use_shm = 1;
+        } else if (strcmp(argv[n], "-threads") == 0 && n + 1 < argc) {
+            threads = atoi(argv[++n]);
+        } else if (strcmp(argv[n], "-affinity") == 0 && n + 1 < argc) {
+            cpucount = parse_cpu_list(argv[++n], cpus, 1024);
+            if (cpucount < 0)
             {
-                printf("{\"ok\": false, \"error\": \"No such ID\"}");
-            } else {
-                cancel_order_by_id(id);
-                print_order(stdout, AllOrders[id]);
+                printf("Couldn't parse CPU list for -affinity. Quitting.\n");
+                return 1;
             }
-
-            end_message(stdout);
-            continue;
+        } else if (argv[n][0] != '-' && namecount < 2) {
+            names[namecount++] = argv[n];
+        } else {
+            printf("Bad arguments (usage: [<venue> <symbol>] [-threads <n>] [-affinity <cpus>] [-shm]). Quitting.\n");
+            return 1;
         }
+    }
+
+    if (namecount == 1)
+    {
+        printf("Backend called with a venue but no symbol. Quitting.\n");
+        return 1;
+    }
 
-        if (strcmp("QUOTE", tokens[0]) == 0)
+    if (use_shm)
+    {
+        if (shm_setup() != 0)
         {
-            print_quote(stdout);
-            end_message(stdout);
-            continue;
+            return 1;
         }
+    }
 
-        if (strcmp("__ACC_FROM_ID__", tokens[0]) == 0)
-        {
-            id = atoi(tokens[1]);
+    // On Windows, set stdout and stderr to not auto-convert \n into \r\n (messes with our binary output)
+    #if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+        _setmode(_fileno(stderr), _O_BINARY);
+    #endif
 
-            if (id < 0 || id > HighestKnownOrder || AllOrders[id] == NULL)
-            {
-                printf("ERROR None");
-            } else {
-                printf("OK %s", AllOrders[id]->account->name);
-            }
+    // The event stream starts with a magic number and its version (see EVENTS above)...
 
-            end_message(stdout);
-            continue;
-        }
+    fprintf(stderr, "DBEV");
+    fputc((EVENT_VERSION >> 24) & 0xFF, stderr);
+    fputc((EVENT_VERSION >> 16) & 0xFF, stderr);
+    fputc((EVENT_VERSION >>  8) & 0xFF, stderr);
+    fputc((EVENT_VERSION      ) & 0xFF, stderr);
+    fflush(stderr);
 
-        if (strcmp("__DEBUG_MEMORY__", tokens[0]) == 0)
+    #if defined(USE_THREADS)
+        NumShards = threads > 1 ? threads : 1;
+    #else
+        (void) threads;
+        NumShards = 1;
+    #endif
+
+    Shards = calloc(NumShards, sizeof(SHARD));
+    check_ptr_or_quit(Shards);
+
+    for (n = 0; n < NumShards; n++)
+    {
+        Shards[n].number = n;
+        Shards[n].cpu = cpucount > 0 ? cpus[n % cpucount] : -1;
+    }
+
+    #if defined(USE_THREADS)
+        for (n = 0; n < NumShards; n++)
         {
-            print_memory_info();
-            end_message(stdout);
-            continue;
+            Shards[n].events.slots = malloc(EVENT_QUEUE_SLOTS * sizeof(EVENT));
+            check_ptr_or_quit(Shards[n].events.slots);
         }
 
-        if (strcmp("__TIMESTAMP__", tokens[0]) == 0)
+        if (pthread_create(&emitter, NULL, emitter_thread, NULL) != 0)
         {
-            print_timestamp();
-            end_message(stdout);
-            continue;
+            printf("FATAL Couldn't start emitter thread. Quitting.\n");
+            fflush(stdout);
+            return 1;
         }
 
-        if (strcmp("__SCORES__", tokens[0]) == 0)
+        UseEmitter = 1;
+    #endif
+
+    if (namecount == 2)
+    {
+        init_book(shard_of(0), 0, names[0], names[1]);
+    }
+
+    // With 1 shard, the main thread does the matching itself. Otherwise it only reads
+    // commands and hands them to the owning thread.
+
+    if (NumShards == 1)
+    {
+        set_affinity(Shards[0].cpu);
+        Shards[0].sparebook = new_book();
+    } else {
+        #if defined(USE_THREADS)
+            for (n = 0; n < NumShards; n++)
+            {
+                queue_init(&Shards[n].queue);
+                if (pthread_create(&Shards[n].thread, NULL, shard_thread, &Shards[n]) != 0)
+                {
+                    printf("FATAL Couldn't start matching thread. Quitting.\n");
+                    fflush(stdout);
+                    return 1;
+                }
+            }
+        #endif
+    }
+
+    while (1)
+    {
+        eofcheck = fgets(input, MAXSTRING, stdin);
+
+        if (eofcheck == NULL)           // i.e. we HAVE reached EOF
         {
-            print_scores();
-            end_message(stdout);
-            continue;
+            LOCK_STREAM(StdoutMutex);
+            printf("FATAL Unexpected EOF on stdin. Quitting.\n");
+            fflush(stdout);
+            exit(1);                    // Not return, since other threads are running
         }
 
-        printf("{\"ok\": false, \"error\": \"Did not comprehend\"}");
-        end_message(stdout);
-        continue;
+        if (NumShards == 1)
+        {
+            handle_command(&Shards[0], input);
+        } else {
+            #if defined(USE_THREADS)
+                queue_push(&shard_of(atoi(input))->queue, input);
+            #endif
+        }
     }
 
     return 0;
 }
+
+#endif
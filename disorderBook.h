@@ -0,0 +1,41 @@
+#ifndef DISORDERBOOK_H
+#define DISORDERBOOK_H
+
+/*  Matching engine API, for use in-process rather than through the backend's
+    stdin/stdout. Compile disorderBook.c with DISORDERBOOK_LIBRARY defined
+    (which leaves out main() and sends no events to stderr).
+
+    Commands and replies are exactly as in the pipe protocol (see the comments
+    at the top of disorderBook.c) except that there is no book number and no
+    REPLY header. A returned reply is not NUL-terminated; it belongs to the
+    book and is valid until the next call on that book.
+
+    Any events caused by the last call can be had from db_events(), as binary
+    records in the usual format (see EVENTS in disorderBook.c) but without the
+    stream header. Their book number is always 0. As with the backend, there
+    are none until something is subscribed to with the SUBSCRIBE command.
+
+    db_version() gives the book's version, as sent in the backend's REPLY
+    header: it changes whenever the orderbook or quote does, and not otherwise.
+
+    Different books may be used from different threads at the same time, but
+    any one book must only be used by one thread at a time.
+*/
+
+#include <stddef.h>
+
+typedef struct Book_struct DB_BOOK;
+
+DB_BOOK * db_new_book (char * venue, char * symbol);
+
+char * db_command (DB_BOOK * book, char * command, size_t * reply_len);
+
+char * db_submit (DB_BOOK * book, char * account, int account_int, int qty, int price, int direction, int orderType, size_t * reply_len);
+char * db_status (DB_BOOK * book, int id, char * account, size_t * reply_len);     // account can be NULL
+char * db_cancel (DB_BOOK * book, int id, char * account, size_t * reply_len);     // to skip the owner check
+
+char * db_events (DB_BOOK * book, size_t * events_len);
+
+unsigned long long db_version (DB_BOOK * book);
+
+#endif
@@ -0,0 +1,57 @@
+//go:build cgo
+// +build cgo
+
+package main
+
+// In-process matching engine (enabled with -inprocess). The C backend is
+// compiled right into the frontend, and each book is called directly, with
+// no backend processes or pipes at all. See disorderBook.h for the API.
+
+/*
+#cgo CFLAGS: -std=c99 -O2 -D_GNU_SOURCE -DDISORDERBOOK_LIBRARY
+#cgo !windows LDFLAGS: -lpthread
+#include <stdlib.h>
+#include "disorderBook.c"
+*/
+import "C"
+
+import (
+    "unsafe"
+)
+
+const ENGINE_AVAILABLE = true
+
+func engine_new_book(venue string, symbol string) unsafe.Pointer {
+
+    c_venue := C.CString(venue)
+    c_symbol := C.CString(symbol)
+    defer C.free(unsafe.Pointer(c_venue))
+    defer C.free(unsafe.Pointer(c_symbol))
+
+    return unsafe.Pointer(C.db_new_book(c_venue, c_symbol))
+}
+
+func engine_command(engine unsafe.Pointer, command string) ([]byte, []byte, uint64) {
+
+    // Returns the reply and any events, copied out of C memory, and the book's version.
+
+    c_command := C.CString(command)
+    defer C.free(unsafe.Pointer(c_command))
+
+    var reply_len C.size_t
+    var events_len C.size_t
+
+    book := (*C.DB_BOOK)(engine)
+
+    reply := C.db_command(book, c_command, &reply_len)
+    res := C.GoBytes(unsafe.Pointer(reply), C.int(reply_len))
+
+    version := uint64(C.db_version(book))
+
+    events := C.db_events(book, &events_len)
+    if events_len == 0 {
+        return res, nil, version
+    }
+
+    return res, C.GoBytes(unsafe.Pointer(events), C.int(events_len)), version
+}
@@ -0,0 +1,20 @@
+//go:build !cgo
+// +build !cgo
+
+package main
+
+// Builds without cgo have no in-process engine; -inprocess is refused at startup.
+
+import (
+    "unsafe"
+)
+
+const ENGINE_AVAILABLE = false
+
+func engine_new_book(venue string, symbol string) unsafe.Pointer {
+    return nil
+}
+
+func engine_command(engine unsafe.Pointer, command string) ([]byte, []byte, uint64) {
+    return nil, nil, 0
+}
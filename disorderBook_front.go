@@ -12,10 +12,14 @@ import (
     "net/http"
     "os"
     "os/exec"
+    "runtime"
+    "sort"
     "strconv"
     "strings"
     "sync"
+    "sync/atomic"
     "time"
+    "unsafe"
 
     "github.com/gorilla/websocket"      // go get github.com/gorilla/websocket
 )
@@ -24,6 +28,7 @@ type PipesStruct struct {
     Stdin io.WriteCloser
     Stdout io.ReadCloser
     Stderr io.ReadCloser
+    Process * os.Process
 }
 
 type OrderStruct struct {
@@ -45,6 +50,15 @@ type OptionsStruct struct {
     DefaultVenue        string
     DefaultSymbol       string
     Excess              bool
+    Shm                 bool
+    Pool                int
+    Workers             int
+    Threads             int
+    Affinity            string
+    InProcess           bool
+    Conflate            string
+    ConflateInterval    time.Duration       // Made from Conflate: tickers at most this often (per book),
+    ConflateBatch       bool                // or once per batch of events
 }
 
 type WsInfo struct {
@@ -53,6 +67,34 @@ type WsInfo struct {
     Symbol              string
     ConnType            int
     MessageChannel      chan string
+    MaxFills            int         // Executions show at most this many of the order's latest fills (-1 for all)
+    Synced              bool        // Book feeds: whether the client has the book as of our mirror (under the book's Depth_MUTEX)
+    Latest              * Mailbox   // Tickers get this instead of MessageChannel, so only ever wait for the latest quote (of each stock)
+    Dropped             uint64      // Messages that didn't fit in MessageChannel (use atomic), which the client is told of
+}
+
+type ClientIndex struct {       // Never changed once made; see WebSocketClients
+    ByBook map[BookKey][]*WsInfo        // Every client, by what it's about (Symbol "" for whole-venue clients)
+    ByAccount map[AccountKey][]*WsInfo  // Executions clients again, by whose executions they are
+    Count int
+}
+
+type BookKey struct {
+    Venue string
+    Symbol string
+    ConnType int
+}
+
+type AccountKey struct {
+    Venue string
+    Account string
+}
+
+type Mailbox struct {           // Holds just one message per symbol; a new one replaces that symbol's
+    Msgs map[string]string      // Symbol --> message waiting to be taken
+    Waiting []string            // Those symbols, in the order their messages first came
+    Wake chan bool              // Has something in it while any message is waiting to be taken
+    Msg_MUTEX sync.Mutex
 }
 
 type Command struct {
@@ -62,11 +104,129 @@ type Command struct {
     HubCommand int
     CreateIfNeeded bool
     ResponseChan chan []byte
+    Stream * StreamQueue        // If set, the reply comes here in pieces instead
+    Version * uint64            // If set, the book's version as of the reply is stored here (before replying)
+    Depth int                   // For the orderbook: only this many levels per side (0 for all)
+    Orders int                  // Likewise orders per side (ORDERBOOK_BINARY only)
 }
 
-type BookInfo struct {
+type Book struct {
     Venue string
     Symbol string
+    ID int                      // The book's number within its worker process
+    Worker *Worker
+    Engine unsafe.Pointer       // In-process mode only (and then there's no Worker)
+    CommandChan chan Command
+    ReplyChan chan []byte       // The worker's reader goroutine passes our replies here
+    Orders map[int]*MirrorOrder // Our open orders, built from events (only touched by whoever reads them)
+    EventSeq uint64             // Sequence number of the last event (likewise)
+    Streaming int32             // Set while a streamed reply is expected from the worker
+    Epoch int64                 // When this Book was made, so that ETags from an earlier one never match
+    Version uint64              // The book's version as of the backend's latest reply (use set_version())
+    Changed chan bool           // If anyone is waiting for the version to change, closed when it does
+    Changed_MUTEX sync.Mutex    // (and then set back to nil)
+    OrderbookSnapshot * Snapshot    // The latest orderbook we made, as JSON (under Snapshot_MUTEX)
+    QuoteSnapshot * Snapshot        // Likewise the latest quote
+    LevelsSnapshot * Snapshot       // and the latest levels
+    Snapshot_MUTEX sync.Mutex
+    SyncPending int32           // Set while a SYNC_SUBSCRIPTIONS command is waiting in CommandChan
+    TickerSubscribed bool       // What the backend has been told we want (only touched by the controller)
+    QuoteMirror bool            // Set once anyone asks for a quote, after which we always want quote events
+    LevelMirror bool            // Likewise for depth events, once anyone asks for the levels
+    DepthSubscribed bool
+    RestingSubscribed bool
+    Depth DepthMirror           // The book's price levels, built from depth events (under Depth_MUTEX)
+    Resting RestingMirror       // Likewise its resting orders, built from book events
+    Depth_MUTEX sync.RWMutex
+    ResyncPending int32         // Set while a RESYNC_DEPTH command is waiting in CommandChan
+    TickerQueued string         // With -conflate, the latest ticker message not yet sent (under Ticker_MUTEX)
+    TickerSent time.Time        // When one was last sent
+    TickerTimer bool            // Set while a timer is waiting to send TickerQueued
+    Ticker_MUTEX sync.Mutex
+    AccountsSubscribed map[string]bool
+}
+
+type DepthMirror struct {       // Only changed by whoever reads the book's events
+    Bids []PriceLevel           // Best first
+    Asks []PriceLevel
+    Version uint64              // The version these are the levels of,
+    Pending bool                // unless some of its EVENT_LEVELs haven't come yet
+    Live bool                   // Set by EVENT_BOOK_RESET, cleared if we miss something
+    Changes []LevelChange       // Levels changed in the current version, for book feed clients
+}
+
+type PriceLevel struct {
+    Price int
+    Qty int64
+    Orders int
+}
+
+type LevelChange struct {
+    Direction int
+    Level PriceLevel
+}
+
+type RestingMirror struct {     // As DepthMirror, but for EVENT_RESTING and EVENT_RESTING_RESET
+    Orders map[int]RestingOrder
+    Version uint64
+    Pending bool
+    Live bool
+    Changes []RestingChange
+}
+
+type RestingOrder struct {
+    Id int
+    Direction int
+    Price int
+    Qty int                     // What's left on the book
+    Filled int
+}
+
+type RestingChange struct {
+    Order RestingOrder
+    Action string               // "add", "fill" or "remove"
+}
+
+type Snapshot struct {
+    Version uint64
+    Json []byte
+}
+
+type MirrorOrder struct {       // Just enough of an order to print it in execution messages
+    Id int
+    Account string
+    Direction int
+    OrderType int
+    OriginalQty int
+    Qty int
+    Price int
+    Ts string
+    TotalFilled int
+    Fills []MirrorFill
+}
+
+type MirrorFill struct {
+    Price int
+    Qty int
+    Ts string
+}
+
+type MirrorTrade struct {
+    StandingId int
+    IncomingId int
+    Fill MirrorFill
+    StandingComplete bool
+    IncomingComplete bool
+}
+
+type Worker struct {            // A backend process, hosting any number of books
+    Pipes PipesStruct
+    Err error                   // Set if the process couldn't be started
+    Ready chan bool             // Closed once Pipes and Err are set
+    Dead chan bool              // Closed once the process has stopped talking to us
+    Books map[int]*Book         // ID --> book (covered by Books_MUTEX)
+    NextID int                  // (covered by Books_MUTEX)
+    Stdin_MUTEX sync.Mutex      // Books take turns to send commands
 }
 
 var HEARTBEAT_OK      = []byte(`{"ok": true, "error": ""}`)
@@ -82,6 +242,8 @@ var AUTH_FAILURE      = []byte(`{"ok": false, "error": "Unknown account or wrong
 var NO_VENUE_HEART    = []byte(`{"ok": false, "error": "Venue not up (create it by using it)"}`)
 var BAD_BOOK_NAME     = []byte(`{"ok": false, "error": "Couldn't create book! Bad name for a book!"}`)
 var TOO_MANY_BOOKS    = []byte(`{"ok": false, "error": "Couldn't create book! Too many books!"}`)
+var BOOK_START_FAILED = []byte(`{"ok": false, "error": "Couldn't create book! Backend failed to start"}`)
+var BOOK_DIED         = []byte(`{"ok": false, "error": "Backend for this book is not responding"}`)
 var NOT_IMPLEMENTED   = []byte(`{"ok": false, "error": "Not implemented"}`)
 var DISABLED          = []byte(`{"ok": false, "error": "Disabled or not enabled. (See command line options)"}`)
 var BAD_ACCOUNT_NAME  = []byte(`{"ok": false, "error": "Bad account name (should be alpha_numeric and sane length)"}`)
@@ -89,7 +251,7 @@ var BAD_DIRECTION     = []byte(`{"ok": false, "error": "Bad direction (should be
 var BAD_ORDERTYPE     = []byte(`{"ok": false, "error": "Bad (unknown) orderType"}`)
 var BAD_PRICE         = []byte(`{"ok": false, "error": "Bad (negative) price"}`)
 var BAD_QTY           = []byte(`{"ok": false, "error": "Bad (non-positive) qty"}`)
-var MYSTERY_HUB_CMD   = []byte(`{"ok": false, "error": "Hub received unknown hub command"}`)
+var MYSTERY_HUB_CMD   = []byte(`{"ok": false, "error": "Received unknown hub command"}`)
 var STATUS_ON_UNKNOWN = []byte(`{"ok": false, "error": "Status/cancel on unknown book"}`)
 var BAD_METHOD        = []byte(`{"ok": false, "error": "Method not allowed, use GET, DELETE, POST only"}`)
 var BAD_METHOD_HERE   = []byte(`{"ok": false, "error": "Method not allowed at this URL"}`)
@@ -115,6 +277,44 @@ const (
 const (
     TICKER = 1
     EXECUTION = 2
+    BOOK_LEVELS = 3             // Book feeds (see add_feed_client()): L2, one entry per price level
+    BOOK_ORDERS = 4             // L3, one entry per resting order
+)
+
+const (
+    EVENT_VERSION = 5           // These must match the C backend (see EVENTS at the top of it)
+    EVENT_ORDER = 1
+    EVENT_TRADE = 2
+    EVENT_CLOSED = 3
+    EVENT_CANCEL = 4
+    EVENT_QUOTE = 5
+    EVENT_OLD_FILL = 6
+    EVENT_LEVEL = 7
+    EVENT_BOOK_RESET = 8
+    EVENT_RESTING = 9
+    EVENT_RESTING_RESET = 10
+)
+
+const (                         // Handled by the controller, never sent to the backend as such
+    SYNC_SUBSCRIPTIONS = "__SYNC_SUBSCRIPTIONS__"
+    RESYNC_DEPTH = "__RESYNC_DEPTH__"
+    ORDERBOOK_LEVELS = "__ORDERBOOK_LEVELS__"
+)
+
+const BOOK_QUEUE_LEN = 256          // Commands that can wait for a book before web handlers block (on that book only)
+const BOOK_DRAIN_TIME = 5 * time.Second     // How long a book that failed to start keeps failing late commands (see book_startup())
+
+const (
+    STREAM_CHUNK_SIZE = 32768       // Streamed replies (see relay_stream()) travel in pieces this big at most,
+    STREAM_QUEUE_BYTES = 8 * STREAM_CHUNK_SIZE         // with this much allowed to wait for the http client,
+    STREAM_STALL_TIMEOUT = 20 * time.Millisecond       // which is given up on if it makes no room for this long when that's full,
+    STREAM_FLUSH_INTERVAL = 50 * time.Millisecond      // gets what it has this often,
+    STREAM_WRITE_TIMEOUT = 10 * time.Second            // and is given up on if it won't take a piece for this long.
+)
+
+const (
+    WAIT_DEFAULT = 30 * time.Second     // How long a request with ?since= waits for a change (see wait_for_change())
+    WAIT_MAX = 120 * time.Second        // if it doesn't say (with ?timeout=<ms>), and the most it can ask for
 )
 
 const FRONTPAGE = `<html>
@@ -141,23 +341,32 @@ const FRONTPAGE = `<html>
 // The following globals are unsafe -- could be touched by multiple goroutines (e.g. web handlers):
 
 var AccountInts = make(map[string]int)
-var WebSocketClients = make([]*WsInfo, 0)
+var Books = make(map[string]map[string]*Book)      // venue --> symbol --> book
+var BookCount = 0
+var Workers = make([]*Worker, 0)                   // Live worker processes
 
 // The following are mutexes for the above:
 
 var AccountInts_MUTEX sync.RWMutex
-var WebSocketClients_MUTEX sync.RWMutex
+var WebSocketClients_MUTEX sync.Mutex              // Only for replacing WebSocketClients (see below)
+var Books_MUTEX sync.RWMutex                        // Covers BookCount and Workers too
+
+// The WebSocket clients are indexed in a ClientIndex that is copy-on-write: a new one replaces
+// the old (under WebSocketClients_MUTEX) whenever a client comes or goes, so readers don't lock:
+
+var WebSocketClients atomic.Value                   // *ClientIndex, read with ws_clients()
 
 // The following globals are safe because they are only written to before the various goroutines start:
 
 var Options OptionsStruct
 var AuthMode = false
 var Auth = make(map[string]string)
+var AuthAccounts = make(map[string][]string)       // The reverse of Auth: API key --> accounts
 
 // The following globals are safe because they are never "written" to as such:
 
 var Upgrader = websocket.Upgrader{ReadBufferSize: 1024, WriteBufferSize: 1024, CheckOrigin: func(r *http.Request) bool {return true}}
-var GlobalCommandChan = make(chan Command)
+var BackendPool chan PipesStruct                    // Spare backends awaiting INIT (nil if -pool 0)
 
 // -------------------------------------------------------------------------------------------------------
 
@@ -169,9 +378,20 @@ func main() {
     flag.StringVar(&Options.DefaultVenue, "venue", "TESTEX", "Default venue")
     flag.StringVar(&Options.DefaultSymbol, "symbol", "FOOBAR", "Default symbol")
     flag.BoolVar(&Options.Excess, "excess", false, "Enable commands that can return excessive responses")
+    flag.BoolVar(&Options.Shm, "shm", false, "Talk to backends through shared memory instead of pipes (Linux only)")
+    flag.IntVar(&Options.Pool, "pool", 2, "Number of spare backends to keep running, ready for new books")
+    flag.IntVar(&Options.Workers, "workers", 1, "Number of backend processes to spread the books over")
+    flag.IntVar(&Options.Threads, "threads", runtime.NumCPU(), "Number of matching threads in each backend process")
+    flag.StringVar(&Options.Affinity, "affinity", "", "CPUs to pin each backend's matching threads to, e.g. 0,2,4-7 (Linux only)")
+    flag.BoolVar(&Options.InProcess, "inprocess", false, "Run the matching engine inside the frontend (needs a cgo build)")
+    flag.StringVar(&Options.Conflate, "conflate", "", "Send each book's ticker at most once per this many ms, or once per batch of events with \"batch\"")
 
     flag.Parse()
 
+    if Options.Workers < 1 {
+        Options.Workers = 1
+    }
+
     fmt.Printf("\ndisorderBook (C+Go version) starting up on port %d\n", Options.Port)
 
     if Options.AccountFilename != "" {
@@ -181,19 +401,29 @@ func main() {
         fmt.Printf("\n-----> Warning: running WITHOUT AUTHENTICATION! <-----\n\n")
     }
 
-    go hub()
+    if Options.Conflate == "batch" {
+        Options.ConflateBatch = true
+    } else if Options.Conflate != "" {
+        ms, err := strconv.Atoi(Options.Conflate)
+        if err != nil || ms < 0 {
+            fmt.Printf("Bad -conflate option (should be a number of milliseconds, or batch).\n\n")
+            os.Exit(1)
+        }
+        Options.ConflateInterval = time.Duration(ms) * time.Millisecond
+    }
 
-    // Create the default venue...
-    result_chan := make(chan []byte)
-    msg := Command{
-        ResponseChan: result_chan,
-        Venue: Options.DefaultVenue,
-        Symbol: Options.DefaultSymbol,
-        CreateIfNeeded: true,
-        Command: "THIS_DOES_NOT_MATTER",
+    if Options.InProcess && ENGINE_AVAILABLE == false {
+        fmt.Printf("This frontend was built without the in-process engine (see README).\n\n")
+        os.Exit(1)
+    }
+
+    if Options.Pool > 0 && Options.InProcess == false {
+        BackendPool = make(chan PipesStruct, Options.Pool)
+        go pool_filler()
     }
-    GlobalCommandChan <- msg
-    <- result_chan              // Need to read a result to prevent deadlock
+
+    // Create the default venue...
+    get_book(Options.DefaultVenue, Options.DefaultSymbol, true)
 
     server_string := fmt.Sprintf("127.0.0.1:%d", Options.Port)
 
@@ -314,7 +544,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 Command: "QUOTE",
                 CreateIfNeeded: true,
             }
-            relay(msg, writer)
+            relay_versioned(msg, writer, request)
             return
         }
     }
@@ -331,8 +561,13 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 Symbol: symbol,
                 Command: "ORDERBOOK_BINARY",
                 CreateIfNeeded: true,
+                Depth: query_limit(request, "depth"),
+                Orders: query_limit(request, "orders"),
             }
-            relay(msg, writer)
+            if query_flag(request, "levels") {
+                msg.Command = ORDERBOOK_LEVELS
+            }
+            relay_versioned(msg, writer, request)
             return
         }
     }
@@ -367,21 +602,19 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 }
             }
 
-            AccountInts_MUTEX.Lock()
-            acc_id, ok := AccountInts[account]
-            if !ok {
-                acc_id = len(AccountInts)
-                AccountInts[account] = acc_id
-            }
-            AccountInts_MUTEX.Unlock()
+            acc_id := get_account_int(account)
 
             msg := Command{
                 Venue: venue,
                 Symbol: symbol,
-                Command: "STATUSALL " + strconv.Itoa(acc_id),
+                Command: "STATUSALL " + strconv.Itoa(acc_id) + query_options(request, "after", "offset", "limit", "fills_offset", "fills_limit"),
                 CreateIfNeeded: true,
             }
-            relay(msg, writer)
+            if wants_stream(request) {
+                relay_stream(msg, writer)
+            } else {
+                relay(msg, writer)
+            }
             return
         }
     }
@@ -406,57 +639,37 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
             return
         }
 
-        // In this instance, the web-handler needs to contact the book for info and NOT
-        // send that on to the client. Once we have the info we can make the real request.
+        command := fmt.Sprintf("STATUS %d", id) + query_options(request, "fills_offset", "fills_limit")
+        if request.Method == "DELETE" || len(pathlist) == 9 {       // The longer path is the alternate cancel URL
+            command = fmt.Sprintf("CANCEL %d", id)
+        }
+
+        // In auth mode we append the accounts this API key is good for, and the
+        // backend checks the order belongs to one of them before doing anything.
 
-        command := "__ACC_FROM_ID__ " + strconv.Itoa(id)
-        result_chan := make(chan []byte)
+        if AuthMode {
+            accounts := AuthAccounts[request_api_key]
+            if len(accounts) == 0 {
+                accounts = []string{"-"}                // Can't match a real account since bad_name() forbids "-"
+            }
+            command += " " + strings.Join(accounts, " ")
+        }
 
         msg := Command{
-            ResponseChan: result_chan,
             Venue: venue,
             Symbol: symbol,
             Command: command,
             CreateIfNeeded: false,
         }
-        GlobalCommandChan <- msg
-        res1 := <- result_chan
+        res := send_command(msg)
 
         // If the book didn't exist we will receive one of these replies...
-        if bytes.Equal(res1, UNKNOWN_VENUE) || bytes.Equal(res1, UNKNOWN_SYMBOL) {
+        if bytes.Equal(res, UNKNOWN_VENUE) || bytes.Equal(res, UNKNOWN_SYMBOL) {
             writer.Write(STATUS_ON_UNKNOWN)
             return
         }
 
-        res1 = bytes.Trim(res1, " \t\n\r")
-        reply_list := bytes.Split(res1, []byte(" "))
-        err_string, account := string(reply_list[0]), string(reply_list[1])
-
-        if err_string == "ERROR" {
-            writer.Write(UNKNOWN_ORDER)
-            return
-        }
-
-        if AuthMode {
-            if Auth[account] != request_api_key || Auth[account] == "" {
-                writer.Write(AUTH_FAILURE)
-                return
-            }
-        }
-
-        if request.Method == "DELETE" || len(pathlist) == 9 {       // The longer path is the alternate cancel URL
-            command = fmt.Sprintf("CANCEL %d", id)
-        } else {
-            command = fmt.Sprintf("STATUS %d", id)
-        }
-
-        msg = Command{
-            Venue: venue,
-            Symbol: symbol,
-            Command: command,
-            CreateIfNeeded: false,
-        }
-        relay(msg, writer)
+        writer.Write(res)
         return
     }
 
@@ -559,13 +772,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
 
             // Do the account-ID generation as late as possible so we don't get unused IDs if we return early
 
-            AccountInts_MUTEX.Lock()
-            acc_id, ok := AccountInts[raw_order.Account]
-            if !ok {
-                acc_id = len(AccountInts)
-                AccountInts[raw_order.Account] = acc_id
-            }
-            AccountInts_MUTEX.Unlock()
+            acc_id := get_account_int(raw_order.Account)
 
             command := fmt.Sprintf("ORDER %s %d %d %d %d %d", raw_order.Account, acc_id, raw_order.Qty, raw_order.Price, int_direction, int_ordertype)
 
@@ -608,449 +815,2428 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
 
 func relay(msg Command, writer http.ResponseWriter) {
 
-    // Send the message to the hub, read the response via a channel,
-    // and then send that response to the http client.
+    // Send the message to the book (or deal with it ourselves if it's a
+    // hub command), and then send the response to the http client.
 
-    result_chan := make(chan []byte)
-    msg.ResponseChan = result_chan
-    GlobalCommandChan <- msg
-    res := <- result_chan
-    writer.Write(res)
+    writer.Write(send_command(msg))
     return
 }
 
-func hub() {
+func send_command(msg Command) []byte {
 
-    // All web-handlers that need some sort of considered response send their commands to the hub.
-    // The real reason for this is that the books are behind a map; accessing which is not thread-safe.
-    // Earlier architecture ended up with a ton of mutex calls and a map of mutexes behind a mutex...
+    if msg.HubCommand != 0 {
+        return handle_hub_command(msg)
+    }
 
-    books := make(map[string]map[string]chan Command)
-    bookcount := 0
+    book, err_reply := get_book(msg.Venue, msg.Symbol, msg.CreateIfNeeded)
+    if book == nil {
+        return err_reply
+    }
 
-    hub_command_chan := make(chan Command)
-    hub_update_chan := make(chan BookInfo)
+    result_chan := make(chan []byte, 1)
+    msg.ResponseChan = result_chan
+    book.CommandChan <- msg
+    return <- result_chan
+}
 
-    go hub_command_handler(hub_command_chan, hub_update_chan)
+func relay_stream(msg Command, writer http.ResponseWriter) {
 
-    for {
-        msg := <- GlobalCommandChan
+    // Like relay(), but the reply is passed on to the http client (chunked) as it
+    // arrives from the backend, so nobody has to hold all of a big reply at once.
+    // The backend, which may be serving many books, barely waits for the client:
+    // pieces it isn't ready for wait in the StreamQueue, up to STREAM_QUEUE_BYTES.
+    // A client that leaves that full for STREAM_STALL_TIMEOUT is cut off, and the
+    // rest of the reply is dropped.
 
-        // Check whether the command was to the hub or to the book...
+    book, err_reply := get_book(msg.Venue, msg.Symbol, msg.CreateIfNeeded)
+    if book == nil {
+        writer.Write(err_reply)
+        return
+    }
 
-        if msg.HubCommand != 0 {
-            hub_command_chan <- msg
-            continue
-        }
+    msg.Stream = new_stream_queue()
+    book.CommandChan <- msg
 
-        // Command was a real command to a book...
-        // But maybe it doesn't exist and we can ignore it?
+    flusher, _ := writer.(http.Flusher)
+    response_controller := http.NewResponseController(writer)
+    last_flush := time.Now()
 
-        venue, symbol := msg.Venue, msg.Symbol
+    for {
+        chunks, done, dropped := msg.Stream.take()
 
-        if msg.CreateIfNeeded == false {
-            if books[venue] == nil {
-                msg.ResponseChan <- UNKNOWN_VENUE
-                continue
-            }
-            if books[venue][symbol] == nil {
-                msg.ResponseChan <- UNKNOWN_SYMBOL
-                continue
-            }
+        if dropped {
+            panic(http.ErrAbortHandler)     // Closes the connection, so the client can't mistake what it got for the whole reply
         }
 
-        // Either the book exists or we need to create it...
-
-        if books[venue] == nil || books[venue][symbol] == nil {     // Short circuits if no venue
-
-            if bad_name(venue) || bad_name(symbol) {
-                msg.ResponseChan <- BAD_BOOK_NAME
-                continue
+        for _, chunk := range chunks {
+            response_controller.SetWriteDeadline(time.Now().Add(STREAM_WRITE_TIMEOUT))
+            _, err := writer.Write(chunk)
+            if err != nil {
+                msg.Stream.abandon()        // The client has gone or stalled
+                panic(http.ErrAbortHandler)
             }
+        }
 
-            if bookcount >= Options.MaxBooks {
-                msg.ResponseChan <- TOO_MANY_BOOKS
-                continue
-            }
+        if done {
+            return
+        }
 
-            if books[venue] == nil {
-                books[venue] = make(map[string]chan Command)
-            }
+        if flusher != nil && time.Since(last_flush) >= STREAM_FLUSH_INTERVAL {
+            response_controller.SetWriteDeadline(time.Now().Add(STREAM_WRITE_TIMEOUT))
+            flusher.Flush()
+            last_flush = time.Now()
+        }
+    }
+}
 
-            new_command_chan := make(chan Command)
-            books[venue][symbol] = new_command_chan
-            bookcount += 1
+type StreamQueue struct {       // A streamed reply on its way to the http client, which hardly ever blocks the sender
+    Chunks [][]byte             // Pieces not yet taken
+    Bytes int                   // Their total size, which may not exceed STREAM_QUEUE_BYTES
+    Done bool                   // Set after the last piece
+    Abandoned bool              // Set once the client has gone or fallen too far behind, after which pieces are dropped
+    Ready chan bool             // Has something in it while there's news to take
+    Taken chan bool             // Likewise when pieces have been taken (making room for more)
+    Queue_MUTEX sync.Mutex
+}
 
-            hub_update_chan <- BookInfo{venue, symbol}
+func new_stream_queue() * StreamQueue {
+    return &StreamQueue{Ready: make(chan bool, 1), Taken: make(chan bool, 1)}
+}
 
-            exec_command := exec.Command("./disorderBook.exe", venue, symbol)
-            i_pipe, _ := exec_command.StdinPipe()
-            o_pipe, _ := exec_command.StdoutPipe()
-            e_pipe, _ := exec_command.StderrPipe()
+func (q * StreamQueue) push(chunk []byte) {
 
-            // Should maybe handle errors from the above.
+    // Adds a piece to the reply, or ends it if chunk is nil. If that would make too
+    // much wait for the client, it gets a moment to make room before it's abandoned.
 
-            new_pipes_struct := PipesStruct{i_pipe, o_pipe, e_pipe}
+    q.Queue_MUTEX.Lock()
 
-            exec_command.Start()
-            go ws_controller(venue, symbol, e_pipe)
-            go controller(venue, symbol, new_pipes_struct, new_command_chan)
-            fmt.Printf("Creating %s %s\n", venue, symbol)
+    for chunk != nil && q.Abandoned == false && q.Bytes > 0 && q.Bytes + len(chunk) > STREAM_QUEUE_BYTES {
+        q.Queue_MUTEX.Unlock()
+        timer := time.NewTimer(STREAM_STALL_TIMEOUT)
+        select {
+            case <- q.Taken:
+                timer.Stop()
+            case <- timer.C:
+                q.abandon()
         }
+        q.Queue_MUTEX.Lock()
+    }
 
-        // The book exists...
+    if chunk == nil {
+        q.Done = true
+    } else if q.Abandoned == false {
+        q.Chunks = append(q.Chunks, chunk)
+        q.Bytes += len(chunk)
+    }
+    q.Queue_MUTEX.Unlock()
 
-        books[venue][symbol] <- msg
+    select {
+        case q.Ready <- true :
+        default:                        // Already has news waiting
     }
 }
 
-func hub_command_handler(hub_command_chan chan Command, hub_update_chan chan BookInfo) {
-
-    // Some commands aren't dealt with by passing them to a book but rather are queries of global state.
-    // This goroutine keeps a copy of the relevant state up-to-date by receiving messages from the hub
-    // about new book creation. It thus is able to deal with the commands for such state.
+func (q * StreamQueue) take() ([][]byte, bool, bool) {
 
-    venue_symbol_map := make(map[string]map[string]bool)   // bool is adequate here
+    // Waits for, and returns, every piece not yet taken, whether that's all of them,
+    // and whether the queue has been abandoned (in which case there are none).
 
     for {
-        select {
-            case cmd := <- hub_command_chan:
-                handle_hub_command(cmd, venue_symbol_map)
+        q.Queue_MUTEX.Lock()
+        chunks, done, dropped := q.Chunks, q.Done, q.Abandoned
+        q.Chunks = nil
+        q.Bytes = 0
+        q.Queue_MUTEX.Unlock()
 
-            case update := <- hub_update_chan:
-                if venue_symbol_map[update.Venue] == nil {
-                    venue_symbol_map[update.Venue] = make(map[string]bool)
-                }
-                venue_symbol_map[update.Venue][update.Symbol] = true
+        if len(chunks) > 0 {
+            select {
+                case q.Taken <- true :
+                default:
+            }
+        }
+
+        if len(chunks) > 0 || done || dropped {
+            return chunks, done, dropped
         }
+        <- q.Ready
     }
 }
 
-func handle_hub_command(msg Command, venue_symbol_map map[string]map[string]bool) {
-    var buffer bytes.Buffer
-    switch msg.HubCommand {
+func (q * StreamQueue) abandon() {
+    q.Queue_MUTEX.Lock()
+    q.Abandoned = true
+    q.Chunks = nil
+    q.Bytes = 0
+    q.Queue_MUTEX.Unlock()
+}
 
-        case VENUES_LIST:
+func wants_stream(request * http.Request) bool {
+    return query_flag(request, "stream")
+}
 
-            commaflag := false
-            buffer.WriteString("{\n  \"ok\": true,\n  \"venues\": [")
-            for v := range venue_symbol_map {
-                name := v + " Exchange"
-                if commaflag {
-                    buffer.WriteString(",")
-                }
-                line := fmt.Sprintf("\n    {\"name\": \"%s\", \"state\": \"open\", \"venue\": \"%s\"}", name, v)
-                buffer.WriteString(line)
-                commaflag = true
-            }
-            buffer.WriteString("\n  ]\n}")
+func query_flag(request * http.Request, name string) bool {
+    value := request.URL.Query().Get(name)
+    return value == "1" || value == "true"
+}
 
-        case VENUE_HEARTBEAT:
+func query_limit(request * http.Request, name string) int {
+    n, err := strconv.Atoi(request.URL.Query().Get(name))
+    if err != nil || n < 0 {
+        return 0                    // i.e. no limit
+    }
+    return n
+}
 
-            if venue_symbol_map[msg.Venue] == nil {
-                buffer.Write(NO_VENUE_HEART)
-            } else {
-                line := fmt.Sprintf(`{"ok": true, "venue": "%s"}`, msg.Venue)
-                buffer.WriteString(line)
-            }
+func send_reply(msg Command, res []byte) {
 
-        case STOCK_LIST:
+    // For replying to a command all at once, whether or not it asked for a stream.
 
-            if venue_symbol_map[msg.Venue] == nil {
-                buffer.Write(NO_VENUE_HEART)
-            } else {
-                commaflag := false
-                buffer.WriteString("{\n  \"ok\": true,\n  \"symbols\": [")
-                for s := range venue_symbol_map[msg.Venue] {
-                    name := s + " Inc"
-                    if commaflag {
-                        buffer.WriteString(",")
-                    }
-                    line := fmt.Sprintf("\n    {\"name\": \"%s\", \"symbol\": \"%s\"}", name, s)
-                    buffer.WriteString(line)
-                    commaflag = true
-                }
-                buffer.WriteString("\n  ]\n}")
-            }
+    if msg.Stream != nil {
+        msg.Stream.push(res)
+        msg.Stream.push(nil)
+    } else if msg.ResponseChan != nil {
+        msg.ResponseChan <- res
+    }
+}
 
-        default:
+func relay_versioned(msg Command, writer http.ResponseWriter, request * http.Request) {
 
-            buffer.Write(MYSTERY_HUB_CMD)
+    // For the orderbook and quote, whose replies only change when the book's
+    // version does. The reply comes with an ETag made from the version, and if
+    // the client already has the current one (If-None-Match) it just gets a 304.
+    // Either way, if the book hasn't changed since the last such reply, the
+    // backend isn't asked at all. With ?since=<version>, we first wait for the
+    // book to be at some other version.
+
+    book, err_reply := get_book(msg.Venue, msg.Symbol, msg.CreateIfNeeded)
+    if book == nil {
+        writer.Write(err_reply)
+        return
     }
 
-    msg.ResponseChan <- buffer.Bytes()
+    if since, err := strconv.ParseUint(request.URL.Query().Get("since"), 10, 64); err == nil {
+        wait_for_change(book, since, wait_timeout(request), request)
+    }
+
+    version := atomic.LoadUint64(&book.Version)
+
+    if etag_matches(request.Header.Get("If-None-Match"), book_etag(book, version)) {
+        writer.Header().Set("ETag", book_etag(book, version))
+        writer.WriteHeader(http.StatusNotModified)
+        return
+    }
+
+    if snapshot := current_snapshot(book, msg); snapshot != nil {
+        writer.Header().Set("ETag", book_etag(book, snapshot.Version))
+        writer.Header().Set("X-Book-Version", strconv.FormatUint(snapshot.Version, 10))
+        writer.Write(snapshot.Json)
+        return
+    }
+
+    if wants_stream(request) && msg.Command != ORDERBOOK_LEVELS {
+        relay_stream(msg, writer)           // No ETag, since the headers go before the version is known
+        return
+    }
+
+    msg.Version = &version
+    res := send_command(msg)
+
+    if bytes.Equal(res, BOOK_DIED) == false {
+        writer.Header().Set("ETag", book_etag(book, version))
+        writer.Header().Set("X-Book-Version", strconv.FormatUint(version, 10))
+    }
+    writer.Write(res)
     return
 }
 
-func controller(venue string, symbol string, pipes PipesStruct, command_chan chan Command)  {
+func set_version(book * Book, version uint64) {
 
-    // This goroutine controls the stdout and stdin for a single backend.
-    // (stderr (for WebSockets) is handled by a different goroutine.)
+    // Called with the version of each reply from the backend. Wakes anyone in
+    // wait_for_change() if it has moved on.
 
-    for {
-        msg := <- command_chan
+    if atomic.SwapUint64(&book.Version, version) == version {
+        return
+    }
 
-        command := msg.Command
+    book.Changed_MUTEX.Lock()
+    if book.Changed != nil {
+        close(book.Changed)
+        book.Changed = nil
+    }
+    book.Changed_MUTEX.Unlock()
+}
 
-        if len(command) == 0 || command[len(command) - 1] != '\n' {
-            command = command + "\n"
-        }
+func wait_for_change(book * Book, since uint64, timeout time.Duration, request * http.Request) {
 
-        fmt.Fprintf(pipes.Stdin, command)
+    // For long polling: returns as soon as the book's version isn't since (which is
+    // likely to be the X-Book-Version the client saw last), or after the timeout,
+    // or if the client goes away. Nothing is asked of the backend meanwhile; we hear
+    // of each change with the reply to whatever command made it.
 
-        if command == "ORDERBOOK_BINARY\n" {      // This is a special case since the response is binary
-            handle_binary_orderbook_response(pipes.Stdout, msg.Venue, msg.Symbol, msg.ResponseChan)
-            continue
-        }
+    book.Changed_MUTEX.Lock()
+    if atomic.LoadUint64(&book.Version) != since {
+        book.Changed_MUTEX.Unlock()
+        return
+    }
+    if book.Changed == nil {
+        book.Changed = make(chan bool)
+    }
+    changed := book.Changed
+    book.Changed_MUTEX.Unlock()
 
-        scanner := bufio.NewScanner(pipes.Stdout)
-        var buffer bytes.Buffer
+    timer := time.NewTimer(timeout)
+    defer timer.Stop()
 
-        for {
-            scanner.Scan()
-            str_piece := scanner.Bytes()
-            if bytes.Equal(str_piece, []byte("END")) {
-                break
-            } else {
-                buffer.Write(str_piece)
-                buffer.WriteByte('\n')
-            }
-        }
+    select {
+        case <- changed:
+        case <- timer.C:
+        case <- request.Context().Done():
+    }
+}
 
-        msg.ResponseChan <- buffer.Bytes()
+func wait_timeout(request * http.Request) time.Duration {
+    ms, err := strconv.Atoi(request.URL.Query().Get("timeout"))
+    if err != nil || ms < 0 {
+        return WAIT_DEFAULT
+    }
+    timeout := time.Duration(ms) * time.Millisecond
+    if timeout > WAIT_MAX {
+        return WAIT_MAX
     }
+    return timeout
 }
 
-func handle_binary_orderbook_response(backend_stdout io.ReadCloser, venue string, symbol string, result_chan chan []byte) {
+func book_etag(book * Book, version uint64) string {
+    return fmt.Sprintf("\"%x-%d\"", book.Epoch, version)
+}
 
-    // The orderbook is the only thing the C backend sends in a binary format (this is
-    // done for speed reasons, as it's potentially a large amount of data, frequently
-    // requested in normal usage). See comments in the C file for format info.
+func etag_matches(if_none_match string, etag string) bool {
 
-    reader := bufio.NewReader(backend_stdout)
+    // If-None-Match can be a list of ETags, possibly weak ("W/..."), or "*".
 
-    var qty uint32
-    var price uint32
-    var commaflag bool
+    for _, tag := range strings.Split(if_none_match, ",") {
+        tag = strings.TrimPrefix(strings.TrimSpace(tag), "W/")
+        if tag == etag || tag == "*" {
+            return true
+        }
+    }
+    return false
+}
 
-    var buffer bytes.Buffer
+func get_book(venue string, symbol string, create bool) (*Book, []byte) {
 
-    buffer.WriteString("{\n  \"ok\": true,\n  \"venue\": \"")
-    buffer.WriteString(venue)
-    buffer.WriteString("\",\n  \"symbol\": \"")
-    buffer.WriteString(symbol)
-    buffer.WriteString("\",\n  \"bids\": [")
+    // Web handlers find their book here and then talk to it directly, so a busy
+    // book only holds up requests for itself. Lookups only need the read lock;
+    // the write lock is taken just for creating a book.
 
-    wrote_any_bids := false
-    wrote_any_asks := false
+    Books_MUTEX.RLock()
+    book := Books[venue][symbol]                // Indexing a nil inner map is fine
+    venue_known := Books[venue] != nil
+    Books_MUTEX.RUnlock()
 
-    commaflag = false
-    for {
-        binary.Read(reader, binary.BigEndian, &qty)
-        binary.Read(reader, binary.BigEndian, &price)
+    if book != nil {
+        return book, nil
+    }
 
-        if qty != 0 {
-            if commaflag {
-                buffer.WriteString(",")
-            }
-            buffer.WriteString("\n    {\"price\": ")
-            buffer.WriteString(strconv.FormatUint(uint64(price), 10))
-            buffer.WriteString(", \"qty\": ")
-            buffer.WriteString(strconv.FormatUint(uint64(qty), 10))
-            buffer.WriteString(", \"isBuy\": true}")
-            commaflag = true
-            wrote_any_bids = true
-        } else {
-            break
+    if create == false {
+        if venue_known == false {
+            return nil, UNKNOWN_VENUE
         }
+        return nil, UNKNOWN_SYMBOL
     }
 
-    if wrote_any_bids {
-        buffer.WriteString("\n  ")
+    if bad_name(venue) || bad_name(symbol) {
+        return nil, BAD_BOOK_NAME
     }
-    buffer.WriteString("],\n  \"asks\": [")
 
-    commaflag = false
-    for {
-        binary.Read(reader, binary.BigEndian, &qty)
-        binary.Read(reader, binary.BigEndian, &price)
+    Books_MUTEX.Lock()
+    defer Books_MUTEX.Unlock()
 
-        if qty != 0 {
-            if commaflag {
-                buffer.WriteString(",")
-            }
-            buffer.WriteString("\n    {\"price\": ")
-            buffer.WriteString(strconv.FormatUint(uint64(price), 10))
-            buffer.WriteString(", \"qty\": ")
-            buffer.WriteString(strconv.FormatUint(uint64(qty), 10))
-            buffer.WriteString(", \"isBuy\": false}")
-            commaflag = true
-            wrote_any_asks = true
-        } else {
-            break
-        }
+    if Books[venue][symbol] != nil {            // Someone else made it while we were waiting for the lock
+        return Books[venue][symbol], nil
     }
 
-    ts, _ := time.Now().UTC().MarshalJSON()
+    if BookCount >= Options.MaxBooks {
+        return nil, TOO_MANY_BOOKS
+    }
+
+    if Books[venue] == nil {
+        Books[venue] = make(map[string]*Book)
+    }
+
+    book = &Book{
+        Venue: venue,
+        Symbol: symbol,
+        CommandChan: make(chan Command, BOOK_QUEUE_LEN),
+        ReplyChan: make(chan []byte, 1),
+        Orders: make(map[int]*MirrorOrder),
+        AccountsSubscribed: make(map[string]bool),
+        Epoch: time.Now().UnixNano(),
+    }
+
+    if Options.InProcess == false {
+        worker := assign_worker()
+        book.ID = worker.NextID
+        book.Worker = worker
+        worker.Books[book.ID] = book
+        worker.NextID += 1
+    }
+
+    Books[venue][symbol] = book
+    BookCount += 1
+
+    // Setting up the book is slow (perhaps a process must be started), so it's done in
+    // the background (without holding the lock). Meanwhile, commands for this book simply
+    // wait in its channel.
+
+    go book_startup(book)
+
+    return book, nil
+}
+
+func assign_worker() *Worker {
+
+    // Must be called with Books_MUTEX held. Start a new worker process until we
+    // have Options.Workers of them, after that use the one with fewest books.
+
+    if len(Workers) < Options.Workers {
+        worker := &Worker{
+            Ready: make(chan bool),
+            Dead: make(chan bool),
+            Books: make(map[int]*Book),
+        }
+        Workers = append(Workers, worker)
+        go worker_startup(worker)
+        return worker
+    }
+
+    best := Workers[0]
+    for _, worker := range Workers {
+        if len(worker.Books) < len(best.Books) {
+            best = worker
+        }
+    }
+    return best
+}
+
+func remove_worker(worker * Worker) {
+
+    // Must be called with Books_MUTEX held. Does nothing if the worker isn't in the list.
+    // Its books stay in the table (failing every request) just as a lone dead backend's did.
+
+    for i, w := range Workers {
+        if w == worker {
+            Workers[i] = Workers[len(Workers) - 1]
+            Workers = Workers[:len(Workers) - 1]
+            break
+        }
+    }
+}
+
+func worker_startup(worker * Worker) {
+
+    // Take a spare backend if there is one, otherwise start one now.
+
+    var pipes PipesStruct
+    var err error
+
+    select {
+        case pipes = <- BackendPool:            // Never ready if BackendPool is nil
+        default:
+            pipes, err = start_backend()
+    }
+
+    worker.Pipes = pipes
+    worker.Err = err
+    close(worker.Ready)
+
+    if err != nil {
+        fmt.Printf("Couldn't start backend: %v\n", err)
+        Books_MUTEX.Lock()
+        remove_worker(worker)
+        Books_MUTEX.Unlock()
+        close(worker.Dead)
+        return
+    }
+
+    go event_reader(worker)
+    worker_reader(worker)
+}
+
+func worker_reader(worker * Worker) {
+
+    // This goroutine reads every reply from a worker's stdout and hands each
+    // one to the book it belongs to (each book has one command in flight at most).
+
+    reader := bufio.NewReader(worker.Pipes.Stdout)
+
+    for {
+        book_id, length, version, err := read_reply_header(reader)
+        if err != nil {
+            fmt.Printf("Backend stopped responding: %v\n", err)
+            break
+        }
+
+        Books_MUTEX.RLock()
+        book := worker.Books[book_id]
+        Books_MUTEX.RUnlock()
+
+        if book != nil {
+            set_version(book, version)          // Before the controller can see the reply
+        }
+
+        if book == nil {
+            fmt.Printf("Backend sent a reply for unknown book %d\n", book_id)
+            _, err = io.CopyN(ioutil.Discard, reader, int64(length))
+        } else if atomic.LoadInt32(&book.Streaming) != 0 {
+            err = read_reply_chunks(reader, length, book.ReplyChan)
+        } else {
+            res := make([]byte, length)
+            _, err = io.ReadFull(reader, res)
+            if err == nil {
+                book.ReplyChan <- res
+            }
+        }
+
+        if err != nil {
+            fmt.Printf("Backend stopped responding: %v\n", err)
+            break
+        }
+    }
+
+    Books_MUTEX.Lock()
+    remove_worker(worker)
+    Books_MUTEX.Unlock()
+
+    close(worker.Dead)
+}
+
+func book_startup(book * Book) {
+
+    fmt.Printf("Creating %s %s\n", book.Venue, book.Symbol)
+
+    if Options.InProcess {
+        book.Engine = engine_new_book(book.Venue, book.Symbol)
+        sync_subscriptions(book)
+        controller(book)
+        return
+    }
+
+    // Wait for the worker process, then tell it about the book.
+    // Don't let anyone near the book until it has answered...
+
+    worker := book.Worker
+    <- worker.Ready
+
+    err := worker.Err
+    if err == nil {
+        var res []byte
+        res, err = worker_send(book, fmt.Sprintf("INIT %s %s", book.Venue, book.Symbol))
+        if err == nil && bytes.HasPrefix(res, []byte(`{"ok": true`)) == false {
+            err = fmt.Errorf("%s", bytes.TrimSpace(res))
+        }
+    }
+
+    if err != nil {
+
+        fmt.Printf("Failed to create %s %s: %v\n", book.Venue, book.Symbol, err)
+
+        // Take the book out of the table (so a later request can try again), then
+        // fail everything sent to it. A handler that got hold of the book just
+        // before it was removed may still send something, so we wait until the
+        // channel has been quiet for BOOK_DRAIN_TIME before giving up on it.
+
+        Books_MUTEX.Lock()
+        delete(Books[book.Venue], book.Symbol)
+        if len(Books[book.Venue]) == 0 {
+            delete(Books, book.Venue)
+        }
+        delete(worker.Books, book.ID)
+        BookCount -= 1
+        Books_MUTEX.Unlock()
+
+        for {
+            select {
+                case msg := <- book.CommandChan:
+                    send_reply(msg, BOOK_START_FAILED)
+                case <- time.After(BOOK_DRAIN_TIME):
+                    return
+            }
+        }
+    }
+
+    sync_subscriptions(book)
+    controller(book)
+}
+
+func start_backend() (PipesStruct, error) {
+
+    // Start a disorderBook.exe, which will wait for INIT commands telling it
+    // which books to host. Normally we talk to it through 3 OS pipes, but with
+    // -shm we try shared memory first (see disorderBook_shm_linux.go)
+
+    if Options.Shm {
+        pipes, err := shm_start(exec.Command("./disorderBook.exe", backend_args()...))
+        if err == nil {
+            return pipes, nil
+        }
+        fmt.Printf("Shared memory transport failed (%v), using pipes\n", err)
+    }
+
+    exec_command := exec.Command("./disorderBook.exe", backend_args()...)
+
+    i_pipe, err := exec_command.StdinPipe()
+    if err != nil {
+        return PipesStruct{}, err
+    }
+    o_pipe, err := exec_command.StdoutPipe()
+    if err != nil {
+        return PipesStruct{}, err
+    }
+    e_pipe, err := exec_command.StderrPipe()
+    if err != nil {
+        return PipesStruct{}, err
+    }
+
+    err = exec_command.Start()
+    if err != nil {
+        return PipesStruct{}, err
+    }
+
+    return PipesStruct{i_pipe, o_pipe, e_pipe, exec_command.Process}, nil
+}
+
+func backend_args() []string {
+
+    args := []string{"-threads", strconv.Itoa(Options.Threads)}
+    if Options.Affinity != "" {
+        args = append(args, "-affinity", Options.Affinity)
+    }
+    return args
+}
+
+func spares_wanted() int {
+
+    // How many spare backends are worth keeping: no more than Options.Pool, and
+    // no more than the workers still to be created (none once they all exist,
+    // until one dies).
+
+    Books_MUTEX.RLock()
+    wanted := Options.Workers - len(Workers)
+    Books_MUTEX.RUnlock()
+
+    if wanted > Options.Pool {
+        wanted = Options.Pool
+    }
+    return wanted
+}
+
+func kill_spare(pipes PipesStruct) {
+    pipes.Process.Kill()
+    pipes.Stdin.Close()
+    pipes.Stdout.Close()
+    pipes.Stderr.Close()
+    pipes.Process.Wait()            // Don't leave a zombie (with -shm, shm_start() is waiting too, and one of us gets it)
+}
+
+func pool_filler() {
+
+    // Keep BackendPool topped up with started (but empty) backends, so creating
+    // a worker doesn't have to wait for a process to start. Spares nobody will
+    // need, e.g. ones started just before the last worker was created, are killed.
+
+    for {
+        if len(BackendPool) > spares_wanted() {
+            select {
+                case pipes := <- BackendPool:
+                    kill_spare(pipes)
+                default:                    // A new worker took it first
+            }
+            continue
+        }
+
+        if len(BackendPool) == spares_wanted() {
+            time.Sleep(time.Second)
+            continue
+        }
+
+        pipes, err := start_backend()
+        if err != nil {
+            fmt.Printf("Couldn't start spare backend: %v\n", err)
+            time.Sleep(5 * time.Second)
+            continue
+        }
+
+        if len(BackendPool) >= spares_wanted() {    // Things changed while it was starting
+            kill_spare(pipes)
+            continue
+        }
+        BackendPool <- pipes                // Only this goroutine adds to it, so there's room
+    }
+}
+
+func handle_hub_command(msg Command) []byte {
+
+    // Some commands aren't dealt with by passing them to a book but rather are queries of global state.
+
+    var buffer bytes.Buffer
+
+    Books_MUTEX.RLock()
+    defer Books_MUTEX.RUnlock()
+
+    switch msg.HubCommand {
+
+        case VENUES_LIST:
+
+            commaflag := false
+            buffer.WriteString("{\n  \"ok\": true,\n  \"venues\": [")
+            for v := range Books {
+                name := v + " Exchange"
+                if commaflag {
+                    buffer.WriteString(",")
+                }
+                line := fmt.Sprintf("\n    {\"name\": \"%s\", \"state\": \"open\", \"venue\": \"%s\"}", name, v)
+                buffer.WriteString(line)
+                commaflag = true
+            }
+            buffer.WriteString("\n  ]\n}")
+
+        case VENUE_HEARTBEAT:
+
+            if Books[msg.Venue] == nil {
+                buffer.Write(NO_VENUE_HEART)
+            } else {
+                line := fmt.Sprintf(`{"ok": true, "venue": "%s"}`, msg.Venue)
+                buffer.WriteString(line)
+            }
+
+        case STOCK_LIST:
+
+            if Books[msg.Venue] == nil {
+                buffer.Write(NO_VENUE_HEART)
+            } else {
+                commaflag := false
+                buffer.WriteString("{\n  \"ok\": true,\n  \"symbols\": [")
+                for s := range Books[msg.Venue] {
+                    name := s + " Inc"
+                    if commaflag {
+                        buffer.WriteString(",")
+                    }
+                    line := fmt.Sprintf("\n    {\"name\": \"%s\", \"symbol\": \"%s\"}", name, s)
+                    buffer.WriteString(line)
+                    commaflag = true
+                }
+                buffer.WriteString("\n  ]\n}")
+            }
+
+        default:
+
+            buffer.Write(MYSTERY_HUB_CMD)
+    }
+
+    return buffer.Bytes()
+}
+
+func controller(book * Book)  {
+
+    // This goroutine passes commands for a single book to its worker process,
+    // one at a time. (The worker's stderr (for WebSockets) is handled elsewhere.)
+    // In in-process mode, it calls the engine itself instead.
+
+    for msg := range book.CommandChan {
+
+        if msg.Command == SYNC_SUBSCRIPTIONS {
+            sync_subscriptions(book)
+            continue
+        }
+
+        if msg.Command == RESYNC_DEPTH {
+            atomic.StoreInt32(&book.ResyncPending, 0)
+            if book.DepthSubscribed {
+                book_send(book, "SUBSCRIBE DEPTH 1")    // Sends the whole book again
+            }
+            if book.RestingSubscribed {
+                book_send(book, "SUBSCRIBE BOOK 1")
+            }
+            continue
+        }
+
+        if msg.Command == ORDERBOOK_LEVELS {
+            levels_command(book, msg)
+            continue
+        }
+
+        command := strings.TrimRight(msg.Command, "\n")
+
+        if command == "ORDERBOOK_BINARY" {
+            command += orderbook_options(msg)
+        }
+
+        if msg.Stream != nil {
+            stream_command(book, command, msg.Stream)
+            continue
+        }
+
+        res, err := book_send(book, command)
+        if err != nil {
+            msg.ResponseChan <- BOOK_DIED
+            continue
+        }
+
+        if msg.Version != nil {
+            *msg.Version = atomic.LoadUint64(&book.Version)
+        }
+
+        if strings.HasPrefix(command, "ORDERBOOK_BINARY") {     // This is a special case since the response is binary
+            handle_binary_orderbook_response(book, bytes.NewReader(res), msg)
+            continue
+        }
+
+        if command == "QUOTE" {
+            store_snapshot(book, &book.QuoteSnapshot, atomic.LoadUint64(&book.Version), res)
+        }
+
+        msg.ResponseChan <- res
+
+        if command == "QUOTE" && book.QuoteMirror == false {
+            book.QuoteMirror = true         // From now on quote events keep QuoteSnapshot current (see handle_event())
+            sync_subscriptions(book)
+        }
+    }
+}
+
+func book_send(book * Book, command string) ([]byte, error) {
+    if book.Engine != nil {
+        return engine_send(book, command), nil
+    }
+    return worker_send(book, command)
+}
+
+func book_stream(book * Book, command string, out io.Writer) error {
+
+    // Like book_send(), but the reply is written to out as it arrives.
+
+    if book.Engine != nil {
+        _, err := out.Write(engine_send(book, command))
+        return err
+    }
+    return worker_stream(book, command, out)
+}
+
+func stream_command(book * Book, command string, stream * StreamQueue) {
+
+    // The controller's way of dealing with a command that wants its reply
+    // streamed (see relay_stream()). Pieces are gathered up to STREAM_CHUNK_SIZE
+    // before being passed on, and then a nil to say that's all.
+
+    chunk_writer := &ChunkWriter{Queue: stream}
+    out := bufio.NewWriterSize(chunk_writer, STREAM_CHUNK_SIZE)
+
+    var err error
+
+    if strings.HasPrefix(command, "ORDERBOOK_BINARY") {
+
+        // The orderbook must be converted to JSON on the way...
+
+        pipe_reader, pipe_writer := io.Pipe()
+        done := make(chan bool)
+
+        go func() {
+            pipe_writer.CloseWithError(book_stream(book, command, pipe_writer))
+            close(done)
+        }()
+
+        err = write_orderbook_json(pipe_reader, out, book.Venue, book.Symbol)
+        pipe_reader.Close()         // In case we stopped early; the backend's reply is still read in full
+        <- done
+
+    } else {
+        err = book_stream(book, command, out)
+    }
+
+    if err != nil && chunk_writer.Sent == false {
+        out.Reset(chunk_writer)     // Nothing sent yet, so we can still give a proper error
+        out.Write(BOOK_DIED)
+    }
+
+    out.Flush()
+    stream.push(nil)
+}
+
+type ChunkWriter struct {       // Passes everything written to it to a StreamQueue (as new slices, of STREAM_CHUNK_SIZE at most)
+    Queue * StreamQueue
+    Sent bool
+}
+
+func (c * ChunkWriter) Write(p []byte) (int, error) {
+    for i := 0; i < len(p); i += STREAM_CHUNK_SIZE {
+        n := len(p) - i
+        if n > STREAM_CHUNK_SIZE {
+            n = STREAM_CHUNK_SIZE
+        }
+        chunk := make([]byte, n)
+        copy(chunk, p[i:])
+        c.Queue.push(chunk)
+        c.Sent = true
+    }
+    return len(p), nil
+}
+
+func sync_subscriptions(book * Book) {
+
+    // Tell the backend which of this book's events have WebSocket clients
+    // waiting for them, so it doesn't bother sending the rest.
+
+    atomic.StoreInt32(&book.SyncPending, 0)         // Any change after this point will ask again
+
+    ticker := book.QuoteMirror
+    depth := book.LevelMirror
+    resting := false
+    accounts := make(map[string]bool)
+
+    index := ws_clients()
+
+    for _, symbol := range []string{book.Symbol, ""} {          // Clients of this book, or of its whole venue
+        if len(index.ByBook[BookKey{book.Venue, symbol, TICKER}]) > 0 {
+            ticker = true
+        }
+        for _, client := range index.ByBook[BookKey{book.Venue, symbol, EXECUTION}] {
+            if bad_name(client.Account) == false {
+                accounts[client.Account] = true
+            }
+        }
+    }
+
+    if len(index.ByBook[BookKey{book.Venue, book.Symbol, BOOK_LEVELS}]) > 0 {
+        depth = true
+    }
+    if len(index.ByBook[BookKey{book.Venue, book.Symbol, BOOK_ORDERS}]) > 0 {
+        resting = true
+    }
+
+    if ticker != book.TickerSubscribed {
+        book_send(book, fmt.Sprintf("SUBSCRIBE TICKER %d", subscribe_flag(ticker)))
+        book.TickerSubscribed = ticker
+    }
+
+    if depth != book.DepthSubscribed {
+        book_send(book, fmt.Sprintf("SUBSCRIBE DEPTH %d", subscribe_flag(depth)))
+        book.DepthSubscribed = depth
+        if depth == false {
+            book.Depth_MUTEX.Lock()
+            book.Depth.Live = false         // No longer kept up to date
+            book.Depth_MUTEX.Unlock()
+        }
+    }
+
+    if resting != book.RestingSubscribed {
+        book_send(book, fmt.Sprintf("SUBSCRIBE BOOK %d", subscribe_flag(resting)))
+        book.RestingSubscribed = resting
+        if resting == false {
+            book.Depth_MUTEX.Lock()
+            book.Resting.Live = false
+            book.Depth_MUTEX.Unlock()
+        }
+    }
+
+    for account := range accounts {
+        if book.AccountsSubscribed[account] == false {
+            book_send(book, fmt.Sprintf("SUBSCRIBE EXECUTIONS %d 1", get_account_int(account)))
+            book.AccountsSubscribed[account] = true
+        }
+    }
+
+    for account := range book.AccountsSubscribed {
+        if accounts[account] == false {
+            book_send(book, fmt.Sprintf("SUBSCRIBE EXECUTIONS %d 0", get_account_int(account)))
+            delete(book.AccountsSubscribed, account)
+        }
+    }
+}
+
+func request_resync(book * Book) {
+
+    // Called by whoever reads the book's events when they find some depth (or book)
+    // events are missing. The controller asks the backend for the whole book again.
+
+    if atomic.CompareAndSwapInt32(&book.ResyncPending, 0, 1) {
+        go func() {
+            book.CommandChan <- Command{Command: RESYNC_DEPTH}
+        }()
+    }
+}
+
+func request_sync(venue string, symbol string) {
+
+    // Called when WebSocket clients come or go. Each affected book (every book
+    // at the venue, if symbol is "") is asked to call sync_subscriptions(). This
+    // is done through its controller so the backend is never told out of turn.
+
+    Books_MUTEX.RLock()
+    defer Books_MUTEX.RUnlock()
+
+    for book_symbol, book := range Books[venue] {
+        if symbol != "" && book_symbol != symbol {
+            continue
+        }
+        if atomic.CompareAndSwapInt32(&book.SyncPending, 0, 1) {
+            go func(book * Book) {
+                book.CommandChan <- Command{Command: SYNC_SUBSCRIPTIONS}
+            }(book)
+        }
+    }
+}
+
+func subscribe_flag(b bool) int {
+    if b {
+        return 1
+    }
+    return 0
+}
+
+func engine_send(book * Book, command string) []byte {
+
+    // In-process mode: run the command in the engine, then deal with any events
+    // it caused (they're in the same format the backends send on stderr).
+
+    res, events, version := engine_command(book.Engine, command)
+    set_version(book, version)
+
+    if len(events) > 0 {
+        handle_events(bufio.NewReader(bytes.NewReader(events)), func(int) *Book { return book })
+    }
+
+    return res
+}
+
+func worker_send(book * Book, command string) ([]byte, error) {
+
+    // Send a command for this book to its worker process, and wait for the reply.
+
+    worker := book.Worker
+
+    worker.Stdin_MUTEX.Lock()
+    _, err := fmt.Fprintf(worker.Pipes.Stdin, "%d %s\n", book.ID, command)
+    worker.Stdin_MUTEX.Unlock()
+
+    if err != nil {
+        return nil, err
+    }
+
+    select {
+        case res := <- book.ReplyChan:
+            return res, nil
+        case <- worker.Dead:
+            return nil, io.ErrUnexpectedEOF
+    }
+}
+
+func worker_stream(book * Book, command string, out io.Writer) error {
+
+    // Like worker_send(), but the worker's reader goroutine passes the reply to
+    // us in pieces (ending with nil), which we write to out as they come.
+
+    worker := book.Worker
+
+    atomic.StoreInt32(&book.Streaming, 1)
+    defer atomic.StoreInt32(&book.Streaming, 0)
+
+    worker.Stdin_MUTEX.Lock()
+    _, err := fmt.Fprintf(worker.Pipes.Stdin, "%d %s\n", book.ID, command)
+    worker.Stdin_MUTEX.Unlock()
+
+    if err != nil {
+        return err
+    }
+
+    var write_err error
+
+    for {
+        select {
+            case chunk := <- book.ReplyChan:
+                if chunk == nil {
+                    return write_err
+                }
+                if write_err == nil {
+                    _, write_err = out.Write(chunk)     // After a failure, just take the rest
+                }
+            case <- worker.Dead:
+                return io.ErrUnexpectedEOF
+        }
+    }
+}
+
+func read_reply_header(reader * bufio.Reader) (int, int, uint64, error) {
+
+    // Read the start of one reply from a backend: a line "REPLY <book> <length> <version>",
+    // which will be followed by exactly <length> bytes. Returns the book, length and version.
+
+    header, err := reader.ReadString('\n')
+    if err != nil {
+        return 0, 0, 0, err
+    }
+
+    fields := strings.Fields(header)
+    if len(fields) != 4 || fields[0] != "REPLY" {
+        return 0, 0, 0, fmt.Errorf("bad reply header %q", strings.TrimSpace(header))
+    }
+
+    book_id, err1 := strconv.Atoi(fields[1])
+    length, err2 := strconv.Atoi(fields[2])
+    version, err3 := strconv.ParseUint(fields[3], 10, 64)
+    if err1 != nil || err2 != nil || err3 != nil || length < 0 {
+        return 0, 0, 0, fmt.Errorf("bad reply header %q", strings.TrimSpace(header))
+    }
+
+    return book_id, length, version, nil
+}
+
+func read_reply_chunks(reader * bufio.Reader, length int, reply_chan chan []byte) error {
+
+    // Pass a reply on in pieces, for worker_stream(), followed by nil.
+
+    for length > 0 {
+        n := length
+        if n > STREAM_CHUNK_SIZE {
+            n = STREAM_CHUNK_SIZE
+        }
+        chunk := make([]byte, n)
+        _, err := io.ReadFull(reader, chunk)
+        if err != nil {
+            return err
+        }
+        reply_chan <- chunk
+        length -= n
+    }
+
+    reply_chan <- nil
+    return nil
+}
+
+func handle_binary_orderbook_response(book * Book, backend_stdout io.Reader, msg Command) {
+
+    // Called by the controller, so book.Version is still that of this reply.
+
+    var buffer bytes.Buffer
+
+    if write_orderbook_json(backend_stdout, &buffer, book.Venue, book.Symbol) != nil {
+        msg.ResponseChan <- BOOK_DIED
+        return
+    }
+
+    if msg.Depth == 0 && msg.Orders == 0 {
+        store_snapshot(book, &book.OrderbookSnapshot, atomic.LoadUint64(&book.Version), buffer.Bytes())
+    }
+
+    msg.ResponseChan <- buffer.Bytes()
+    return
+}
+
+func orderbook_options(msg Command) string {
+
+    // The backend options for however much of the orderbook was asked for.
+
+    options := ""
+    if msg.Depth > 0 {
+        options += fmt.Sprintf(" depth=%d", msg.Depth)
+    }
+    if msg.Orders > 0 {
+        options += fmt.Sprintf(" orders=%d", msg.Orders)
+    }
+    return options
+}
+
+func store_snapshot(book * Book, snapshot_ptr ** Snapshot, version uint64, json []byte) {
+
+    // Snapshots come from the controller (made at book.Version) or, for quotes, from
+    // events, which may arrive before or after the reply that has the same version.
+    // Either way, keep whichever is newest.
+
+    book.Snapshot_MUTEX.Lock()
+    if *snapshot_ptr == nil || (*snapshot_ptr).Version <= version {
+        *snapshot_ptr = &Snapshot{Version: version, Json: json}
+    }
+    book.Snapshot_MUTEX.Unlock()
+}
+
+func current_snapshot(book * Book, msg Command) * Snapshot {
+
+    // The book's last reply to the command (ORDERBOOK_BINARY, ORDERBOOK_LEVELS or
+    // QUOTE), if the book hasn't changed since, else nil. An orderbook's "ts" is thus
+    // when it was made, not now; but the contents are the same. The levels can also
+    // be made fresh from the book's DepthMirror, if that's up to date. Only whole
+    // books are kept as snapshots; anything less is always made fresh.
+
+    command := msg.Command
+
+    book.Snapshot_MUTEX.Lock()
+    snapshot := book.QuoteSnapshot
+    if command == "ORDERBOOK_BINARY" {
+        snapshot = book.OrderbookSnapshot
+    } else if command == ORDERBOOK_LEVELS {
+        snapshot = book.LevelsSnapshot
+    }
+    if msg.Depth > 0 || msg.Orders > 0 {
+        snapshot = nil
+    }
+    book.Snapshot_MUTEX.Unlock()
+
+    if command == ORDERBOOK_LEVELS && (snapshot == nil || snapshot.Version != atomic.LoadUint64(&book.Version)) {
+        snapshot = mirror_snapshot(book, msg.Depth)
+    }
+
+    if snapshot == nil || snapshot.Version != atomic.LoadUint64(&book.Version) {
+        return nil
+    }
+
+    return snapshot
+}
+
+func levels_command(book * Book, msg Command) {
+
+    // The controller's way of getting the levels when the book's DepthMirror can't
+    // help (see current_snapshot()). From then on, the mirror is kept up to date.
+
+    command := "LEVELS_BINARY"
+    if msg.Depth > 0 {
+        command += fmt.Sprintf(" depth=%d", msg.Depth)
+    }
+
+    res, err := book_send(book, command)
+    if err != nil {
+        msg.ResponseChan <- BOOK_DIED
+        return
+    }
+
+    version := atomic.LoadUint64(&book.Version)
+    if msg.Version != nil {
+        *msg.Version = version
+    }
+
+    bids, asks, err := read_levels(bufio.NewReader(bytes.NewReader(res)))
+    if err != nil {
+        msg.ResponseChan <- BOOK_DIED
+        return
+    }
+
+    var buffer bytes.Buffer
+    write_levels_json(&buffer, book.Venue, book.Symbol, bids, asks)
+    if msg.Depth == 0 {
+        store_snapshot(book, &book.LevelsSnapshot, version, buffer.Bytes())
+    }
+
+    msg.ResponseChan <- buffer.Bytes()
+
+    if book.LevelMirror == false {
+        book.LevelMirror = true
+        sync_subscriptions(book)
+    }
+}
+
+func read_levels(reader * bufio.Reader) ([]PriceLevel, []PriceLevel, error) {
+
+    // Reads the backend's reply to LEVELS_BINARY (see the C file for the format).
+
+    var sides [2][]PriceLevel
+    record := make([]byte, 16)
+
+    for i := 0; i < 2; i++ {
+        for {
+            if _, err := io.ReadFull(reader, record); err != nil {
+                return nil, nil, err
+            }
+            qty := int64(binary.BigEndian.Uint64(record[0:8]))
+            if qty == 0 {
+                break
+            }
+            price := int(binary.BigEndian.Uint32(record[8:12]))
+            orders := int(binary.BigEndian.Uint32(record[12:16]))
+            sides[i] = append(sides[i], PriceLevel{Price: price, Qty: qty, Orders: orders})
+        }
+    }
+
+    return sides[0], sides[1], nil
+}
+
+func mirror_snapshot(book * Book, depth int) * Snapshot {
+
+    // The levels (only the best depth of each side, unless depth is 0) from the
+    // book's DepthMirror, if it's live and has caught up with the latest reply
+    // from the backend, else nil.
+
+    book.Depth_MUTEX.RLock()
+
+    mirror := &book.Depth
+    if mirror.Live == false || mirror.Pending || mirror.Version != atomic.LoadUint64(&book.Version) {
+        book.Depth_MUTEX.RUnlock()
+        return nil
+    }
+
+    var buffer bytes.Buffer
+    write_levels_json(&buffer, book.Venue, book.Symbol, top_levels(mirror.Bids, depth), top_levels(mirror.Asks, depth))
+    version := mirror.Version
+
+    book.Depth_MUTEX.RUnlock()
+
+    if depth == 0 {
+        store_snapshot(book, &book.LevelsSnapshot, version, buffer.Bytes())
+    }
+    return &Snapshot{Version: version, Json: buffer.Bytes()}
+}
+
+func top_levels(levels []PriceLevel, depth int) []PriceLevel {
+    if depth > 0 && len(levels) > depth {
+        return levels[:depth]
+    }
+    return levels
+}
+
+func write_levels_json(buffer * bytes.Buffer, venue string, symbol string, bids []PriceLevel, asks []PriceLevel) {
+
+    // Laid out like the orderbook, but with one entry per price level.
+
+    fmt.Fprintf(buffer, "{\n  \"ok\": true,\n  \"venue\": \"%s\",\n  \"symbol\": \"%s\",\n  \"bids\": [", venue, symbol)
+
+    for i, levels := range [2][]PriceLevel{bids, asks} {
+        if i == 1 {
+            buffer.WriteString("],\n  \"asks\": [")
+        }
+        for n, level := range levels {
+            if n > 0 {
+                buffer.WriteString(",")
+            }
+            fmt.Fprintf(buffer, "\n    {\"price\": %d, \"qty\": %d, \"orders\": %d, \"isBuy\": %v}", level.Price, level.Qty, level.Orders, i == 0)
+        }
+        if len(levels) > 0 {
+            buffer.WriteString("\n  ")
+        }
+    }
+
+    ts, _ := time.Now().UTC().MarshalJSON()
+
+    buffer.WriteString("],\n  \"ts\": ")
+    buffer.Write(ts)
+    buffer.WriteString("\n}")
+}
+
+func apply_level(book * Book, version uint64, direction int, level PriceLevel, more bool) {
+
+    // An EVENT_LEVEL. Must be called with Depth_MUTEX held for writing.
+
+    mirror := &book.Depth
+
+    if mirror.Live == false {
+        return                      // Waiting for a resync
+    }
+
+    expected := mirror.Version + 1
+    if mirror.Pending {
+        expected = mirror.Version
+    }
+
+    if version != expected {
+        fmt.Printf("Depth for %s %s skipped from %d to %d\n", book.Venue, book.Symbol, mirror.Version, version)
+        lose_depth(book)
+        return
+    }
+
+    mirror.Version = version
+    mirror.Pending = more
+
+    if direction == BUY {
+        mirror.Bids = set_level(mirror.Bids, level, true)
+    } else {
+        mirror.Asks = set_level(mirror.Asks, level, false)
+    }
+
+    mirror.Changes = append(mirror.Changes, LevelChange{direction, level})
+
+    if more == false {
+        feed_book(book, BOOK_LEVELS, func() string {
+            return levels_update_json(book)
+        })
+        mirror.Changes = mirror.Changes[:0]
+    }
+}
+
+func lose_depth(book * Book) {
+
+    // The DepthMirror (or RestingMirror) has missed something, so can't be used until
+    // the backend has sent the whole book again. Must be called with Depth_MUTEX held
+    // for writing. The resync is asked for even if we were already waiting for one,
+    // in case what we missed was the start of it.
+
+    book.Depth.Live = false
+    book.Resting.Live = false
+    request_resync(book)
+}
+
+func set_level(levels []PriceLevel, level PriceLevel, descending bool) []PriceLevel {
+
+    // Put the level in its place (or take it out, if its qty is 0).
+
+    i := sort.Search(len(levels), func(n int) bool {
+        if descending {
+            return levels[n].Price <= level.Price
+        }
+        return levels[n].Price >= level.Price
+    })
+
+    if i < len(levels) && levels[i].Price == level.Price {
+        if level.Qty == 0 {
+            return append(levels[:i], levels[i + 1:]...)
+        }
+        levels[i] = level
+        return levels
+    }
+
+    if level.Qty == 0 {
+        return levels
+    }
+
+    levels = append(levels, PriceLevel{})
+    copy(levels[i + 1:], levels[i:])
+    levels[i] = level
+    return levels
+}
+
+func apply_resting(book * Book, version uint64, order RestingOrder, more bool) {
+
+    // An EVENT_RESTING. Must be called with Depth_MUTEX held for writing. Works out
+    // what happened to the order by comparing it with what we knew of it before.
+
+    mirror := &book.Resting
+
+    if mirror.Live == false {
+        return
+    }
+
+    expected := mirror.Version + 1
+    if mirror.Pending {
+        expected = mirror.Version
+    }
+
+    if version != expected {
+        fmt.Printf("Book for %s %s skipped from %d to %d\n", book.Venue, book.Symbol, mirror.Version, version)
+        lose_depth(book)
+        return
+    }
+
+    mirror.Version = version
+    mirror.Pending = more
+
+    old, known := mirror.Orders[order.Id]
+
+    action := "remove"
+    if known == false {
+        action = "add"
+    } else if order.Filled > old.Filled {
+        action = "fill"
+    }
+
+    if order.Qty == 0 {
+        delete(mirror.Orders, order.Id)
+    } else {
+        mirror.Orders[order.Id] = order
+    }
+
+    mirror.Changes = append(mirror.Changes, RestingChange{order, action})
+
+    if more == false {
+        feed_book(book, BOOK_ORDERS, func() string {
+            return resting_update_json(book)
+        })
+        mirror.Changes = mirror.Changes[:0]
+    }
+}
+
+type JsonWriter interface {
+    Write(p []byte) (int, error)
+    WriteString(s string) (int, error)
+}
+
+func write_orderbook_json(backend_stdout io.Reader, out JsonWriter, venue string, symbol string) error {
+
+    // The orderbook is the only thing the C backend sends in a binary format (this is
+    // done for speed reasons, as it's potentially a large amount of data, frequently
+    // requested in normal usage). See comments in the C file for format info.
+
+    reader := bufio.NewReader(backend_stdout)
+
+    var qty uint32
+    var price uint32
+    var commaflag bool
+
+    out.WriteString("{\n  \"ok\": true,\n  \"venue\": \"")
+    out.WriteString(venue)
+    out.WriteString("\",\n  \"symbol\": \"")
+    out.WriteString(symbol)
+    out.WriteString("\",\n  \"bids\": [")
+
+    wrote_any_bids := false
+    wrote_any_asks := false
+
+    commaflag = false
+    for {
+        if err := read_orderbook_entry(reader, &qty, &price); err != nil {
+            return err
+        }
+
+        if qty != 0 {
+            if commaflag {
+                out.WriteString(",")
+            }
+            out.WriteString("\n    {\"price\": ")
+            out.WriteString(strconv.FormatUint(uint64(price), 10))
+            out.WriteString(", \"qty\": ")
+            out.WriteString(strconv.FormatUint(uint64(qty), 10))
+            out.WriteString(", \"isBuy\": true}")
+            commaflag = true
+            wrote_any_bids = true
+        } else {
+            break
+        }
+    }
+
+    if wrote_any_bids {
+        out.WriteString("\n  ")
+    }
+    out.WriteString("],\n  \"asks\": [")
+
+    commaflag = false
+    for {
+        if err := read_orderbook_entry(reader, &qty, &price); err != nil {
+            return err
+        }
+
+        if qty != 0 {
+            if commaflag {
+                out.WriteString(",")
+            }
+            out.WriteString("\n    {\"price\": ")
+            out.WriteString(strconv.FormatUint(uint64(price), 10))
+            out.WriteString(", \"qty\": ")
+            out.WriteString(strconv.FormatUint(uint64(qty), 10))
+            out.WriteString(", \"isBuy\": false}")
+            commaflag = true
+            wrote_any_asks = true
+        } else {
+            break
+        }
+    }
+
+    ts, _ := time.Now().UTC().MarshalJSON()
+
+    if wrote_any_asks {
+        out.WriteString("\n  ")
+    }
+    out.WriteString("],\n  \"ts\": ")
+    out.Write(ts)                           // Already has quotes around it
+    _, err := out.WriteString("\n}")
+
+    return err
+}
+
+func read_orderbook_entry(reader * bufio.Reader, qty * uint32, price * uint32) error {
+    err := binary.Read(reader, binary.BigEndian, qty)
+    if err == nil {
+        err = binary.Read(reader, binary.BigEndian, price)
+    }
+    return err
+}
+
+// WebSocket strategy:  http://www.gorillatoolkit.org/pkg/websocket
+//
+// For each incoming WS connection, the goroutine ws_handler() puts an entry
+// in a global struct, storing account, venue, and symbol (some of which
+// are optional). It also stores a channel used for communication.
+//
+// Each C backend sends binary events to stderr. There is one goroutine per
+// backend process -- event_reader() -- that reads these, keeps each book's
+// copy of its open orders up to date, and renders WebSocket messages, but
+// only those that some client is actually waiting for. These are passed on
+// via the channels. In in-process mode, the book's controller handles the
+// events itself.
+//
+// Whenever clients come or go, the affected books tell their backend which
+// events are wanted at all (see sync_subscriptions()), so that a book with
+// no listeners costs nothing here.
+
+func ws_handler(writer http.ResponseWriter, request * http.Request) {
+
+    // Each time the /ob/api/ws URL is hit, this is called as a new goroutine.
+
+    conn, err := Upgrader.Upgrade(writer, request, nil)
+    if err != nil {
+        return
+    }
+
+    path_clean := strings.Trim(request.URL.Path, "\n\r\t /")
+    pathlist := strings.Split(path_clean, "/")
+
+    if len(pathlist) < 3 || pathlist[0] != "ob" || pathlist[1] != "api" || pathlist[2] != "ws" {
+        return
+    }
+
+    var account string
+    var venue string
+    var symbol string
+    var info WsInfo
+
+    message_channel := make(chan string, 128)        // Dunno what buffer is appropriate (tickers don't use it)
+
+    // Executions clients can ask for fewer fills with ?fills=<n>, since orders with
+    // many fills otherwise make every execution message bigger than the last.
+
+    max_fills := -1
+    if n, err := strconv.Atoi(request.URL.Query().Get("fills")); err == nil && n >= 0 {
+        max_fills = n
+    }
+
+    //ob/api/ws/:trading_account/venues/:venue/tickertape/stocks/:stock
+    if len(pathlist) == 9 && pathlist[4] == "venues" && pathlist[6] == "tickertape" && pathlist[7] == "stocks" {
+        account = ""
+        venue = pathlist[5]
+        symbol = pathlist[8]
+        info = WsInfo{Account: account, Venue: venue, Symbol: symbol, ConnType: TICKER, Latest: new_mailbox()}
+        append_to_ws_client_list(&info)
+
+    //ob/api/ws/:trading_account/venues/:venue/tickertape
+    } else if len(pathlist) == 7 && pathlist[4] == "venues" && pathlist[6] == "tickertape" {
+        account = ""
+        venue = pathlist[5]
+        symbol = ""
+        info = WsInfo{Account: account, Venue: venue, Symbol: symbol, ConnType: TICKER, Latest: new_mailbox()}
+        append_to_ws_client_list(&info)
+
+    //ob/api/ws/:trading_account/venues/:venue/executions/stocks/:symbol
+    } else if len(pathlist) == 9 && pathlist[4] == "venues" && pathlist[6] == "executions" && pathlist[7] == "stocks" {
+        account = pathlist[3]
+        venue = pathlist[5]
+        symbol = pathlist[8]
+        info = WsInfo{Account: account, Venue: venue, Symbol: symbol, ConnType: EXECUTION, MessageChannel: message_channel, MaxFills: max_fills}
+        append_to_ws_client_list(&info)
+
+    //ob/api/ws/:trading_account/venues/:venue/executions
+    } else if len(pathlist) == 7 && pathlist[4] == "venues" && pathlist[6] == "executions" {
+        account = pathlist[3]
+        venue = pathlist[5]
+        symbol = ""
+        info = WsInfo{Account: account, Venue: venue, Symbol: symbol, ConnType: EXECUTION, MessageChannel: message_channel, MaxFills: max_fills}
+        append_to_ws_client_list(&info)
+
+    //ob/api/ws/:trading_account/venues/:venue/stocks/:stock/book   (?level=3 for orders rather than levels)
+    } else if len(pathlist) == 9 && pathlist[4] == "venues" && pathlist[6] == "stocks" && pathlist[8] == "book" {
+        account = ""
+        venue = pathlist[5]
+        symbol = pathlist[7]
+        book, _ := get_book(venue, symbol, true)
+        if book == nil {
+            conn.Close()
+            return
+        }
+        conn_type := BOOK_LEVELS
+        if request.URL.Query().Get("level") == "3" {
+            conn_type = BOOK_ORDERS
+        }
+        info = WsInfo{Account: account, Venue: venue, Symbol: symbol, ConnType: conn_type, MessageChannel: message_channel, MaxFills: max_fills}
+        add_feed_client(book, &info)
+
+    // invalid URL
+    } else {
+        conn.Close()
+        return
+    }
+
+    go ws_null_reader(conn, &info)     // This handles reading and discarding incoming messages
+
+    var wake chan bool                  // A nil channel never receives, so non-tickers just wait for message_channel
+    if info.Latest != nil {
+        wake = info.Latest.Wake
+    }
+
+    var reported uint64
+    var msgs []string
+    single := make([]string, 1)
+
+    for {
+        select {
+            case single[0] = <- message_channel :
+                msgs = single
+            case <- wake :
+                msgs = info.Latest.take()
+                if len(msgs) == 0 {
+                    continue            // Already sent, when we took them after an earlier wake
+                }
+        }
+
+        for _, msg := range msgs {
+            err = conn.WriteMessage(websocket.TextMessage, []byte(msg))
+            if err != nil {
+                break
+            }
+        }
+
+        // If some messages were dropped because the client was too slow, say so (once
+        // it has caught up with those that weren't), along with how many so far.
+
+        if dropped := atomic.LoadUint64(&info.Dropped); dropped != reported && err == nil {
+            reported = dropped
+            err = conn.WriteMessage(websocket.TextMessage, []byte(fmt.Sprintf(
+                "{\"ok\": false, \"error\": \"Too slow, some messages were not sent\", \"dropped\": %d}\n", dropped)))
+        }
+
+        if err != nil {
+            remove_from_ws_client_list(&info)
+            return      // The function ws_null_reader() will likely close the connection.
+        }
+    }
+}
+
+func new_mailbox() * Mailbox {
+    return &Mailbox{Msgs: make(map[string]string), Wake: make(chan bool, 1)}
+}
+
+func (m * Mailbox) post(symbol string, msg string) {
+    m.Msg_MUTEX.Lock()
+    if _, ok := m.Msgs[symbol]; ok == false {
+        m.Waiting = append(m.Waiting, symbol)
+    }
+    m.Msgs[symbol] = msg
+    m.Msg_MUTEX.Unlock()
+    select {
+        case m.Wake <- true :
+        default:                        // Already waiting to be taken
+    }
+}
+
+func (m * Mailbox) take() []string {
+
+    // Returns the waiting messages (one per symbol) and empties the mailbox, so none
+    // is ever sent twice (a post() can come after the wake but before this, waking
+    // us again).
+
+    m.Msg_MUTEX.Lock()
+    defer m.Msg_MUTEX.Unlock()
+
+    msgs := make([]string, 0, len(m.Waiting))
+    for _, symbol := range m.Waiting {
+        msgs = append(msgs, m.Msgs[symbol])
+        delete(m.Msgs, symbol)
+    }
+    m.Waiting = m.Waiting[:0]
+    return msgs
+}
+
+func event_reader(worker * Worker) {
+
+    // See comments above for WebSocket strategy. This goroutine is responsible
+    // for reading the stderr of a single C backend (which may host many books).
+
+    reader := bufio.NewReader(worker.Pipes.Stderr)
+
+    header := make([]byte, 8)
+    _, err := io.ReadFull(reader, header)
+    if err != nil {
+        return                          // The backend has gone
+    }
+
+    if string(header[0:4]) != "DBEV" || binary.BigEndian.Uint32(header[4:8]) != EVENT_VERSION {
+        fmt.Printf("Backend sent events in an unknown format (header %q); ignoring them\n", header)
+        io.Copy(ioutil.Discard, reader)     // Must keep reading, or the backend would block
+        return
+    }
+
+    books := make(map[int]*Book)        // Our own cache, to save taking the lock for each event
+
+    find_book := func(book_id int) *Book {
+        book := books[book_id]
+        if book == nil {
+            Books_MUTEX.RLock()
+            book = worker.Books[book_id]
+            Books_MUTEX.RUnlock()
+            if book != nil {
+                books[book_id] = book
+            }
+        }
+        return book
+    }
+
+    err = handle_events(reader, find_book)
+    if err != nil && err != io.EOF {
+        fmt.Printf("Bad event stream from backend: %v\n", err)
+        io.Copy(ioutil.Discard, reader)
+    }
+}
+
+func handle_events(reader * bufio.Reader, find_book func(int) *Book) error {
+
+    // Reads event records (see the C file for the format) until the reader is
+    // exhausted, applying each to the book it belongs to.
+
+    length_bytes := make([]byte, 4)
+    var record []byte
+    var tickers []*Book                 // With -conflate batch, books whose ticker is queued
+
+    for {
+        _, err := io.ReadFull(reader, length_bytes)
+        if err != nil {
+            return err
+        }
+
+        length := int(binary.BigEndian.Uint32(length_bytes))
+        if length < 13 {
+            return fmt.Errorf("event record too short (%d bytes)", length)
+        }
+
+        if cap(record) < length {
+            record = make([]byte, length)
+        }
+        record = record[:length]
+
+        _, err = io.ReadFull(reader, record)
+        if err != nil {
+            return err
+        }
+
+        event_type := int(record[0])
+        book_id := int(binary.BigEndian.Uint32(record[1:5]))
+        seq := binary.BigEndian.Uint64(record[5:13])
+
+        book := find_book(book_id)
+        if book == nil {
+            fmt.Printf("Backend sent an event for unknown book %d\n", book_id)
+            continue
+        }
+
+        if seq != book.EventSeq + 1 {
+            fmt.Printf("Events for %s %s skipped from %d to %d\n", book.Venue, book.Symbol, book.EventSeq, seq)
+            book.Depth_MUTEX.Lock()
+            lose_depth(book)                    // Some of them might have been levels
+            book.Depth_MUTEX.Unlock()
+        }
+        book.EventSeq = seq
+
+        handle_event(book, event_type, &EventFields{data: record[13:]})
+
+        if Options.ConflateBatch {
+            if event_type == EVENT_QUOTE && book_in_list(tickers, book) == false {
+                tickers = append(tickers, book)
+            }
+            if reader.Buffered() == 0 {             // We've caught up with the backend, for now
+                for _, book := range tickers {
+                    book.Ticker_MUTEX.Lock()
+                    flush_ticker(book)
+                    book.Ticker_MUTEX.Unlock()
+                }
+                tickers = tickers[:0]
+            }
+        }
+    }
+}
+
+func book_in_list(list []*Book, book * Book) bool {
+    for _, item := range list {
+        if item == book {
+            return true
+        }
+    }
+    return false
+}
+
+type EventFields struct {       // For taking fields off the front of an event record, in order
+    data []byte
+    bad bool                    // Set if we ran off the end
+}
+
+func (f * EventFields) int8() int {
+    if len(f.data) < 1 {
+        f.bad = true
+        return 0
+    }
+    n := int(f.data[0])
+    f.data = f.data[1:]
+    return n
+}
+
+func (f * EventFields) int32() int {
+    if len(f.data) < 4 {
+        f.bad = true
+        return 0
+    }
+    n := int(int32(binary.BigEndian.Uint32(f.data)))
+    f.data = f.data[4:]
+    return n
+}
+
+func (f * EventFields) int64() int64 {
+    if len(f.data) < 8 {
+        f.bad = true
+        return 0
+    }
+    n := int64(binary.BigEndian.Uint64(f.data))
+    f.data = f.data[8:]
+    return n
+}
+
+func (f * EventFields) str() string {
+    n := f.int8()
+    if len(f.data) < n {
+        f.bad = true
+        return ""
+    }
+    str := string(f.data[:n])
+    f.data = f.data[n:]
+    return str
+}
+
+func handle_event(book * Book, event_type int, fields * EventFields) {
+
+    switch event_type {
+
+        case EVENT_ORDER:
+
+            order := &MirrorOrder{}
+            order.Id = fields.int32()
+            order.Direction = fields.int8()
+            order.OrderType = fields.int8()
+            order.OriginalQty = fields.int32()
+            order.Qty = order.OriginalQty
+            order.Price = fields.int32()
+            order.Account = fields.str()
+            order.Ts = fields.str()
+            if fields.bad == false {
+                book.Orders[order.Id] = order
+            }
+
+        case EVENT_TRADE:
+
+            trade := MirrorTrade{}
+            trade.StandingId = fields.int32()
+            trade.IncomingId = fields.int32()
+            trade.Fill.Price = fields.int32()
+            trade.Fill.Qty = fields.int32()
+            trade.Fill.Ts = fields.str()
+            trade.StandingComplete = fields.int8() != 0
+            trade.IncomingComplete = fields.int8() != 0
+            if fields.bad {
+                break
+            }
+
+            // We only have orders of accounts that are subscribed to, so one side may be missing...
+
+            for _, id := range []int{trade.StandingId, trade.IncomingId} {
+                order := book.Orders[id]
+                if order == nil {
+                    continue
+                }
+                add_fill(order, trade.Fill)
+                ws_deliver(EXECUTION, order.Account, book.Venue, book.Symbol, func(max_fills int) string {
+                    return execution_json(book, order, &trade, max_fills)
+                })
+            }
+
+            // Orders that are done will never be mentioned again...
+
+            if trade.StandingComplete {
+                delete(book.Orders, trade.StandingId)
+            }
+            if trade.IncomingComplete {
+                delete(book.Orders, trade.IncomingId)
+            }
+
+        case EVENT_OLD_FILL:
+
+            id := fields.int32()
+            fill := MirrorFill{}
+            fill.Price = fields.int32()
+            fill.Qty = fields.int32()
+            fill.Ts = fields.str()
+            if fields.bad == false && book.Orders[id] != nil {
+                add_fill(book.Orders[id], fill)
+            }
+
+        case EVENT_CLOSED, EVENT_CANCEL:
+
+            id := fields.int32()
+            if fields.bad == false {
+                delete(book.Orders, id)
+            }
 
-    if wrote_any_asks {
-        buffer.WriteString("\n  ")
-    }
-    buffer.WriteString("],\n  \"ts\": ")
-    buffer.Write(ts)                        // Already has quotes around it
-    buffer.WriteString("\n}")
+        case EVENT_QUOTE:
+
+            var q QuoteFields
+            q.Bid = fields.int32()
+            q.Ask = fields.int32()
+            q.BidSize = fields.int64()
+            q.AskSize = fields.int64()
+            q.BidDepth = fields.int64()
+            q.AskDepth = fields.int64()
+            q.Last = fields.int32()
+            q.LastSize = fields.int32()
+            q.LastTrade = fields.str()
+            q.QuoteTime = fields.str()
+            version := uint64(fields.int64())
+            if fields.bad {
+                break
+            }
 
-    result_chan <- buffer.Bytes()
-    return
-}
+            quote := quote_json(book, &q)
+            store_snapshot(book, &book.QuoteSnapshot, version, []byte(quote))     // So the quote route needn't ask the backend
 
-// WebSocket strategy:  http://www.gorillatoolkit.org/pkg/websocket
-//
-// For each incoming WS connection, the goroutine ws_handler() puts an entry
-// in a global struct, storing account, venue, and symbol (some of which
-// are optional). It also stores a channel used for communication.
-//
-// Each C backend sends messages to stderr. There is one goroutine per
-// backend -- ws_controller() -- that reads these messages and passes them
-// on via the channels (only sending to the correct clients).
+            queue_ticker(book, "{\"ok\": true, \"quote\": " + quote + "}\n")
 
-func ws_handler(writer http.ResponseWriter, request * http.Request) {
+        case EVENT_LEVEL:
 
-    // Each time the /ob/api/ws URL is hit, this is called as a new goroutine.
+            version := uint64(fields.int64())
+            direction := fields.int8()
+            level := PriceLevel{}
+            level.Price = fields.int32()
+            level.Qty = fields.int64()
+            level.Orders = fields.int32()
+            more := fields.int8() != 0
+            if fields.bad {
+                break
+            }
 
-    conn, err := Upgrader.Upgrade(writer, request, nil)
-    if err != nil {
+            book.Depth_MUTEX.Lock()
+            apply_level(book, version, direction, level, more)
+            book.Depth_MUTEX.Unlock()
+
+        case EVENT_BOOK_RESET:
+
+            version := uint64(fields.int64())
+            more := fields.int8() != 0
+            if fields.bad {
+                break
+            }
+
+            book.Depth_MUTEX.Lock()
+            book.Depth = DepthMirror{Version: version, Pending: more, Live: true}
+            unsync_feed(book, BOOK_LEVELS)
+            if more == false {
+                feed_book(book, BOOK_LEVELS, nil)
+            }
+            book.Depth_MUTEX.Unlock()
+
+        case EVENT_RESTING:
+
+            version := uint64(fields.int64())
+            order := RestingOrder{}
+            order.Id = fields.int32()
+            order.Direction = fields.int8()
+            order.Price = fields.int32()
+            order.Qty = fields.int32()
+            order.Filled = fields.int32()
+            more := fields.int8() != 0
+            if fields.bad {
+                break
+            }
+
+            book.Depth_MUTEX.Lock()
+            apply_resting(book, version, order, more)
+            book.Depth_MUTEX.Unlock()
+
+        case EVENT_RESTING_RESET:
+
+            version := uint64(fields.int64())
+            more := fields.int8() != 0
+            if fields.bad {
+                break
+            }
+
+            book.Depth_MUTEX.Lock()
+            book.Resting = RestingMirror{Orders: make(map[int]RestingOrder), Version: version, Pending: more, Live: true}
+            unsync_feed(book, BOOK_ORDERS)
+            if more == false {
+                feed_book(book, BOOK_ORDERS, nil)
+            }
+            book.Depth_MUTEX.Unlock()
+
+        // Unknown types are from some newer backend; skip them.
+    }
+}
+
+func queue_ticker(book * Book, msg string) {
+
+    // Normally every quote goes straight out to the book's ticker clients. With
+    // -conflate, a quote may instead wait in TickerQueued, where a newer one simply
+    // replaces it: so clients get fewer messages in a burst, but always the latest.
+
+    if Options.ConflateInterval == 0 && Options.ConflateBatch == false {
+        deliver_ticker(book, msg)
         return
     }
 
-    path_clean := strings.Trim(request.URL.Path, "\n\r\t /")
-    pathlist := strings.Split(path_clean, "/")
+    book.Ticker_MUTEX.Lock()
+    defer book.Ticker_MUTEX.Unlock()
 
-    if len(pathlist) < 3 || pathlist[0] != "ob" || pathlist[1] != "api" || pathlist[2] != "ws" {
+    book.TickerQueued = msg
+
+    if Options.ConflateBatch || book.TickerTimer {
+        return                      // handle_events() or the timer will send it
+    }
+
+    wait := book.TickerSent.Add(Options.ConflateInterval).Sub(time.Now())
+    if wait <= 0 {
+        book.TickerQueued = ""
+        book.TickerSent = time.Now()
+        deliver_ticker(book, msg)
         return
     }
 
-    var account string
-    var venue string
-    var symbol string
-    var info WsInfo
+    book.TickerTimer = true
+    time.AfterFunc(wait, func() {
+        book.Ticker_MUTEX.Lock()
+        book.TickerTimer = false
+        flush_ticker(book)
+        book.Ticker_MUTEX.Unlock()
+    })
+}
 
-    message_channel := make(chan string, 128)        // Dunno what buffer is appropriate
+func flush_ticker(book * Book) {
 
-    //ob/api/ws/:trading_account/venues/:venue/tickertape/stocks/:stock
-    if len(pathlist) == 9 && pathlist[4] == "venues" && pathlist[6] == "tickertape" && pathlist[7] == "stocks" {
-        account = ""
-        venue = pathlist[5]
-        symbol = pathlist[8]
-        info = WsInfo{account, venue, symbol, TICKER, message_channel}
-        append_to_ws_client_list(&info)
+    // Sends the queued ticker message, if any. Must be called with Ticker_MUTEX held.
 
-    //ob/api/ws/:trading_account/venues/:venue/tickertape
-    } else if len(pathlist) == 7 && pathlist[4] == "venues" && pathlist[6] == "tickertape" {
-        account = ""
-        venue = pathlist[5]
-        symbol = ""
-        info = WsInfo{account, venue, symbol, TICKER, message_channel}
-        append_to_ws_client_list(&info)
+    if book.TickerQueued != "" {
+        deliver_ticker(book, book.TickerQueued)
+        book.TickerQueued = ""
+        book.TickerSent = time.Now()
+    }
+}
 
-    //ob/api/ws/:trading_account/venues/:venue/executions/stocks/:symbol
-    } else if len(pathlist) == 9 && pathlist[4] == "venues" && pathlist[6] == "executions" && pathlist[7] == "stocks" {
-        account = pathlist[3]
-        venue = pathlist[5]
-        symbol = pathlist[8]
-        info = WsInfo{account, venue, symbol, EXECUTION, message_channel}
-        append_to_ws_client_list(&info)
+func deliver_ticker(book * Book, msg string) {
+    ws_deliver(TICKER, "", book.Venue, book.Symbol, func(int) string {
+        return msg
+    })
+}
 
-    //ob/api/ws/:trading_account/venues/:venue/executions
-    } else if len(pathlist) == 7 && pathlist[4] == "venues" && pathlist[6] == "executions" {
-        account = pathlist[3]
-        venue = pathlist[5]
-        symbol = ""
-        info = WsInfo{account, venue, symbol, EXECUTION, message_channel}
-        append_to_ws_client_list(&info)
+func add_fill(order * MirrorOrder, fill MirrorFill) {
+    order.Qty -= fill.Qty
+    order.TotalFilled += fill.Qty
+    order.Fills = append(order.Fills, fill)
+}
 
-    // invalid URL
-    } else {
-        conn.Close()
-        return
+type QuoteFields struct {
+    Bid int
+    Ask int
+    BidSize int64
+    AskSize int64
+    BidDepth int64
+    AskDepth int64
+    Last int
+    LastSize int
+    LastTrade string
+    QuoteTime string
+}
+
+// The JSON below is laid out exactly as the backend lays out its replies.
+
+func quote_json(book * Book, q * QuoteFields) string {
+
+    var buffer bytes.Buffer
+
+    fmt.Fprintf(&buffer, "{\n  \"ok\": true,\n  \"symbol\": \"%s\",\n  \"venue\": \"%s\",\n  \"bidSize\": %d,\n" +
+                         "  \"askSize\": %d,\n  \"bidDepth\": %d,\n  \"askDepth\": %d,\n  \"quoteTime\": \"%s\"",
+                book.Symbol, book.Venue, q.BidSize, q.AskSize, q.BidDepth, q.AskDepth, q.QuoteTime)
+
+    if q.Bid >= 0 {                     // -1 used as a null value
+        fmt.Fprintf(&buffer, ",\n  \"bid\": %d", q.Bid)
+    }
+    if q.Ask >= 0 {
+        fmt.Fprintf(&buffer, ",\n  \"ask\": %d", q.Ask)
+    }
+    if q.LastTrade != "" {
+        fmt.Fprintf(&buffer, ",\n  \"lastTrade\": \"%s\",\n  \"lastSize\": %d,\n  \"last\": %d", q.LastTrade, q.LastSize, q.Last)
     }
 
-    go ws_null_reader(conn, &info)     // This handles reading and discarding incoming messages
+    buffer.WriteString("\n}")
+    return buffer.String()
+}
 
-    for {
-        msg := <- message_channel
-        err = conn.WriteMessage(websocket.TextMessage, []byte(msg))
-        if err != nil {
-            remove_from_ws_client_list(&info)
-            return      // The function ws_null_reader() will likely close the connection.
+func order_json(buffer * bytes.Buffer, book * Book, order * MirrorOrder, max_fills int) {
+
+    direction := "buy"
+    if order.Direction == SELL {
+        direction = "sell"
+    }
+
+    orderType := "unknown"
+    switch order.OrderType {
+        case LIMIT: orderType = "limit"
+        case MARKET: orderType = "market"
+        case IOC: orderType = "immediate-or-cancel"
+        case FOK: orderType = "fill-or-kill"
+    }
+
+    fmt.Fprintf(buffer, "{\n  \"ok\": true,\n  \"venue\": \"%s\",\n  \"symbol\": \"%s\",\n  \"direction\": \"%s\",\n  \"originalQty\": %d,\n  \"qty\": %d," +
+                        "\n  \"price\": %d,\n  \"orderType\": \"%s\",\n  \"id\": %d,\n  \"account\": \"%s\",\n  \"ts\": \"%s\",\n  \"totalFilled\": %d,\n  \"open\": %v,\n",
+                book.Venue, book.Symbol, direction, order.OriginalQty, order.Qty,
+                order.Price, orderType, order.Id, order.Account, order.Ts, order.TotalFilled, order.Qty > 0)
+
+    fills := order.Fills
+    if max_fills >= 0 && len(fills) > max_fills {
+        fills = fills[len(fills) - max_fills:]        // Just the latest ones
+    }
+
+    if len(fills) == 0 {
+        buffer.WriteString("  \"fills\": []")
+    } else {
+        buffer.WriteString("  \"fills\": [\n")
+        for i, fill := range fills {
+            if i > 0 {
+                buffer.WriteString(",\n")
+            }
+            fmt.Fprintf(buffer, "    {\"price\": %d, \"qty\": %d, \"ts\": \"%s\"}", fill.Price, fill.Qty, fill.Ts)
         }
+        buffer.WriteString("\n  ]")
     }
+
+    buffer.WriteString("\n}")
 }
 
-func ws_controller(venue string, symbol string, backend_stderr io.ReadCloser) {
+func execution_json(book * Book, order * MirrorOrder, trade * MirrorTrade, max_fills int) string {
 
-    // See comments above for WebSocket strategy. This goroutine is responsible
-    // for reading the stderr of a single C backend (i.e. a single book). It
-    // then passes WebSocket messages on to the relevant connections.
+    var buffer bytes.Buffer
 
-    scanner := bufio.NewScanner(backend_stderr)
+    fmt.Fprintf(&buffer, "{\n  \"ok\": true,\n  \"account\": \"%s\",\n  \"venue\": \"%s\",\n  \"symbol\": \"%s\",\n  \"order\":\n",
+                order.Account, book.Venue, book.Symbol)
 
-    for {
-        scanner.Scan()
-        headers := strings.Split(scanner.Text(), " ")
+    order_json(&buffer, book, order, max_fills)
 
-        var msg_type int
+    fmt.Fprintf(&buffer, ",\n  \"standingId\": %d,\n  \"incomingId\": %d,\n  \"price\": %d,\n  \"filled\": %d,\n  \"filledAt\": \"%s\",\n" +
+                         "  \"standingComplete\": %v,\n  \"incomingComplete\": %v\n}\n",
+                trade.StandingId, trade.IncomingId, trade.Fill.Price, trade.Fill.Qty, trade.Fill.Ts, trade.StandingComplete, trade.IncomingComplete)
 
-        // The backend sends a header line in format TYPE ACCOUNT VENUE SYMBOL
-        // (the last 2 pieces aren't needed as we know what they are already).
+    return buffer.String()
+}
 
-        if headers[0] == "TICKER" {
-            msg_type = TICKER
-        } else if headers[0] == "EXECUTION" {
-            msg_type = EXECUTION
-        } else {
-            msg_type = 0
-            fmt.Println("Unknown WS message type received from backend!")
-            fmt.Println("Headers: ", headers)
-        }
+func ws_deliver(msg_type int, account string, venue string, symbol string, render func(max_fills int) string) {
 
-        var buffer bytes.Buffer
+    // Send a message to every client that wants it. The message is only
+    // rendered if there is at least one such client (and once for each
+    // different limit on fills those clients have asked for). Only those
+    // clients are looked at, thanks to the index (see WebSocketClients).
 
-        for {
-            scanner.Scan()
-            str_piece := scanner.Text()
-            if str_piece != "END" {
-                buffer.WriteString(str_piece)
-                buffer.WriteByte('\n')
-            } else {
-                break
-            }
-        }
+    var rendered map[int]string
+    var lists [2][]*WsInfo
 
-        WebSocketClients_MUTEX.RLock()
+    index := ws_clients()
 
-        for _, client := range WebSocketClients {
+    if msg_type == EXECUTION {
+        lists[0] = index.ByAccount[AccountKey{venue, account}]
+    } else {
+        lists[0] = index.ByBook[BookKey{venue, symbol, msg_type}]
+        lists[1] = index.ByBook[BookKey{venue, "", msg_type}]         // Whole-venue clients
+    }
 
-            if client.ConnType != msg_type {
-                continue
+    for _, list := range lists {
+        for _, client := range list {
+
+            if client.Symbol != symbol && client.Symbol != "" {
+                continue                    // Executions for some other stock at the venue
             }
-            if client.Account != headers[1] && client.ConnType == EXECUTION {
-                continue
+
+            msg, ok := rendered[client.MaxFills]
+            if ok == false {
+                if rendered == nil {
+                    rendered = make(map[int]string)
+                }
+                msg = render(client.MaxFills)
+                rendered[client.MaxFills] = msg
             }
-            if client.Venue != venue {
+
+            if client.Latest != nil {
+                client.Latest.post(symbol, msg)             // Replacing any older one for the stock not yet sent
                 continue
             }
-            if client.Symbol != symbol && client.Symbol != "" {
+
+            select {
+                case client.MessageChannel <- msg :         // Send message unless buffer is full
+                default:
+                    atomic.AddUint64(&client.Dropped, 1)
+            }
+        }
+    }
+}
+
+func add_feed_client(book * Book, info_ptr * WsInfo) {
+
+    // Book feeds get a snapshot of the book (from the DepthMirror or RestingMirror)
+    // and then an update each time its version changes. The snapshot is sent now
+    // if the mirror is up to date; if not, feed_book() sends it once it is.
+
+    book.Depth_MUTEX.Lock()
+    defer book.Depth_MUTEX.Unlock()
+
+    append_to_ws_client_list(info_ptr)      // Which asks for the events we need, if they're not already on
+
+    live := book.Depth.Live && book.Depth.Pending == false
+    if info_ptr.ConnType == BOOK_ORDERS {
+        live = book.Resting.Live && book.Resting.Pending == false
+    }
+
+    if live {
+        info_ptr.MessageChannel <- feed_snapshot_json(book, info_ptr.ConnType)      // The channel is new, so has room
+        info_ptr.Synced = true
+    }
+}
+
+func feed_book(book * Book, conn_type int, render func() string) {
+
+    // Called whenever the book's mirror of this type has caught up with a new version.
+    // Clients that are in sync get the update (if render isn't nil); the rest get a
+    // snapshot instead, as does any client whose channel is too full for the update,
+    // next time round. Must be called with Depth_MUTEX held for writing.
+
+    var update string
+    var snapshot string
+
+    for _, client := range ws_clients().ByBook[BookKey{book.Venue, book.Symbol, conn_type}] {
+
+        if client.Synced {
+            if render == nil {
                 continue
             }
+            if update == "" {
+                update = render()
+            }
             select {
-                case client.MessageChannel <- buffer.String() :         // Send message unless buffer is full
+                case client.MessageChannel <- update :
                 default:
+                    client.Synced = false       // It has missed this one, so needs the whole book again
+            }
+            continue
+        }
+
+        if snapshot == "" {
+            snapshot = feed_snapshot_json(book, conn_type)
+        }
+        select {
+            case client.MessageChannel <- snapshot :
+                client.Synced = true
+            default:
+        }
+    }
+}
+
+func unsync_feed(book * Book, conn_type int) {
+
+    // The mirror has been reset, so every client needs a fresh snapshot.
+    // Must be called with Depth_MUTEX held for writing.
+
+    for _, client := range ws_clients().ByBook[BookKey{book.Venue, book.Symbol, conn_type}] {
+        client.Synced = false
+    }
+}
+
+func feed_snapshot_json(book * Book, conn_type int) string {
+
+    // The whole book, as a book feed's first message. L2 entries are levels; L3
+    // entries are resting orders, in priority order. Must be called with Depth_MUTEX held.
+
+    var buffer bytes.Buffer
+
+    if conn_type == BOOK_LEVELS {
+        feed_header(&buffer, book, "snapshot", book.Depth.Version)
+        buffer.WriteString(",\n  \"bids\": [")
+        for i, levels := range [2][]PriceLevel{book.Depth.Bids, book.Depth.Asks} {
+            if i == 1 {
+                buffer.WriteString("],\n  \"asks\": [")
+            }
+            for n, level := range levels {
+                if n > 0 {
+                    buffer.WriteString(",")
+                }
+                fmt.Fprintf(&buffer, "\n    {\"price\": %d, \"qty\": %d, \"orders\": %d}", level.Price, level.Qty, level.Orders)
+            }
+        }
+        buffer.WriteString("]\n}\n")
+        return buffer.String()
+    }
+
+    var sides [2][]RestingOrder
+    for _, order := range book.Resting.Orders {
+        if order.Direction == BUY {
+            sides[0] = append(sides[0], order)
+        } else {
+            sides[1] = append(sides[1], order)
+        }
+    }
+
+    feed_header(&buffer, book, "snapshot", book.Resting.Version)
+    buffer.WriteString(",\n  \"bids\": [")
+    for i, orders := range sides {
+        sort.Slice(orders, func(a, b int) bool {
+            if orders[a].Price != orders[b].Price {
+                return (orders[a].Price > orders[b].Price) == (i == 0)      // Best price first
+            }
+            return orders[a].Id < orders[b].Id
+        })
+        if i == 1 {
+            buffer.WriteString("],\n  \"asks\": [")
+        }
+        for n, order := range orders {
+            if n > 0 {
+                buffer.WriteString(",")
             }
+            fmt.Fprintf(&buffer, "\n    {\"id\": %d, \"price\": %d, \"qty\": %d}", order.Id, order.Price, order.Qty)
+        }
+    }
+    buffer.WriteString("]\n}\n")
+    return buffer.String()
+}
+
+func levels_update_json(book * Book) string {
+
+    // The levels changed in the latest version (qty 0 for those now gone).
+
+    var buffer bytes.Buffer
+
+    feed_header(&buffer, book, "update", book.Depth.Version)
+    buffer.WriteString(",\n  \"levels\": [")
+    for n, change := range book.Depth.Changes {
+        if n > 0 {
+            buffer.WriteString(",")
+        }
+        fmt.Fprintf(&buffer, "\n    {\"price\": %d, \"qty\": %d, \"orders\": %d, \"isBuy\": %v}",
+                    change.Level.Price, change.Level.Qty, change.Level.Orders, change.Direction == BUY)
+    }
+    buffer.WriteString("]\n}\n")
+    return buffer.String()
+}
+
+func resting_update_json(book * Book) string {
+
+    // The orders changed in the latest version, with what happened to them. Their
+    // qty is what's left on the book (0 if they're gone).
+
+    var buffer bytes.Buffer
+
+    feed_header(&buffer, book, "update", book.Resting.Version)
+    buffer.WriteString(",\n  \"orders\": [")
+    for n, change := range book.Resting.Changes {
+        if n > 0 {
+            buffer.WriteString(",")
         }
+        fmt.Fprintf(&buffer, "\n    {\"id\": %d, \"price\": %d, \"qty\": %d, \"isBuy\": %v, \"action\": \"%s\"}",
+                    change.Order.Id, change.Order.Price, change.Order.Qty, change.Order.Direction == BUY, change.Action)
+    }
+    buffer.WriteString("]\n}\n")
+    return buffer.String()
+}
+
+func feed_header(buffer * bytes.Buffer, book * Book, msg_type string, version uint64) {
+    fmt.Fprintf(buffer, "{\n  \"ok\": true,\n  \"type\": \"%s\",\n  \"venue\": \"%s\",\n  \"symbol\": \"%s\",\n  \"version\": %d",
+                msg_type, book.Venue, book.Symbol, version)
+}
 
-        WebSocketClients_MUTEX.RUnlock()
+func ws_clients() * ClientIndex {
+    index, _ := WebSocketClients.Load().(*ClientIndex)
+    if index == nil {
+        return &ClientIndex{}           // Nobody has connected yet (nil maps are fine to read)
     }
+    return index
 }
 
 func append_to_ws_client_list(info_ptr * WsInfo) {
@@ -1058,8 +3244,10 @@ func append_to_ws_client_list(info_ptr * WsInfo) {
     WebSocketClients_MUTEX.Lock()
     defer WebSocketClients_MUTEX.Unlock()
 
-    WebSocketClients = append(WebSocketClients, info_ptr)
-    fmt.Printf("WebSocket -OPEN- ... Active == %d\n", len(WebSocketClients))
+    index := change_ws_clients(info_ptr, true)
+    fmt.Printf("WebSocket -OPEN- ... Active == %d\n", index.Count)
+
+    request_sync(info_ptr.Venue, info_ptr.Symbol)
     return
 }
 
@@ -1070,17 +3258,82 @@ func remove_from_ws_client_list(info_ptr * WsInfo) {
     WebSocketClients_MUTEX.Lock()
     defer WebSocketClients_MUTEX.Unlock()
 
-    for i, client_ptr := range WebSocketClients {
+    index := change_ws_clients(info_ptr, false)
+    if index != nil {
+        fmt.Printf("WebSocket CLOSED ... Active == %d\n", index.Count)
+        request_sync(info_ptr.Venue, info_ptr.Symbol)
+    }
+    return
+}
+
+func change_ws_clients(info_ptr * WsInfo, add bool) * ClientIndex {
+
+    // Makes and installs a new ClientIndex, with the client added or removed. Only
+    // the maps and the lists the client is in are copied; the rest are shared with
+    // the old index (which anyone may still be reading). Returns nil if the client
+    // to be removed wasn't there. Must be called with WebSocketClients_MUTEX held.
+
+    old := ws_clients()
+
+    book_key := BookKey{info_ptr.Venue, info_ptr.Symbol, info_ptr.ConnType}
+    book_list, ok := change_client_list(old.ByBook[book_key], info_ptr, add)
+    if ok == false {
+        return nil
+    }
+
+    index := &ClientIndex{Count: old.Count + 1}
+    if add == false {
+        index.Count = old.Count - 1
+    }
+
+    index.ByBook = make(map[BookKey][]*WsInfo, len(old.ByBook) + 1)
+    for key, list := range old.ByBook {
+        index.ByBook[key] = list
+    }
+    if len(book_list) == 0 {
+        delete(index.ByBook, book_key)          // So that every venue and symbol ever seen doesn't stay forever
+    } else {
+        index.ByBook[book_key] = book_list
+    }
+
+    index.ByAccount = old.ByAccount
+    if info_ptr.ConnType == EXECUTION {
+        account_key := AccountKey{info_ptr.Venue, info_ptr.Account}
+        account_list, _ := change_client_list(old.ByAccount[account_key], info_ptr, add)
+        index.ByAccount = make(map[AccountKey][]*WsInfo, len(old.ByAccount) + 1)
+        for key, list := range old.ByAccount {
+            index.ByAccount[key] = list
+        }
+        if len(account_list) == 0 {
+            delete(index.ByAccount, account_key)
+        } else {
+            index.ByAccount[account_key] = account_list
+        }
+    }
+
+    WebSocketClients.Store(index)
+    return index
+}
+
+func change_client_list(list []*WsInfo, info_ptr * WsInfo, add bool) ([]*WsInfo, bool) {
+
+    // Returns a new list with the client added or removed (the old one is left
+    // alone), and whether that could be done.
+
+    if add {
+        new_list := make([]*WsInfo, len(list), len(list) + 1)
+        copy(new_list, list)
+        return append(new_list, info_ptr), true
+    }
+
+    for i, client_ptr := range list {
         if client_ptr == info_ptr {
-            // Replace the pointer to this client by the final
-            // pointer in the list, then shorten the list by 1.
-            WebSocketClients[i] = WebSocketClients[len(WebSocketClients) - 1]
-            WebSocketClients = WebSocketClients[:len(WebSocketClients) - 1]
-            fmt.Printf("WebSocket CLOSED ... Active == %d\n", len(WebSocketClients))
-            break
+            new_list := make([]*WsInfo, 0, len(list) - 1)
+            new_list = append(new_list, list[:i]...)
+            return append(new_list, list[i + 1:]...), true
         }
     }
-    return
+    return list, false
 }
 
 func ws_null_reader(conn * websocket.Conn, info_ptr * WsInfo) {
@@ -1099,6 +3352,40 @@ func ws_null_reader(conn * websocket.Conn, info_ptr * WsInfo) {
 
 // Minor utility functions follow...
 
+func query_options(request * http.Request, names ...string) string {
+
+    // Turns those of the named query parameters that are non-negative integers into
+    // options for the backend (see STATUS and STATUSALL in the C file), e.g. " limit=50".
+
+    var buffer bytes.Buffer
+
+    query := request.URL.Query()
+
+    for _, name := range names {
+        n, err := strconv.Atoi(query.Get(name))
+        if err == nil && n >= 0 {
+            fmt.Fprintf(&buffer, " %s=%d", name, n)
+        }
+    }
+
+    return buffer.String()
+}
+
+func get_account_int(account string) int {
+
+    // Every account gets a unique, low integer for the backends (see the C file).
+
+    AccountInts_MUTEX.Lock()
+    defer AccountInts_MUTEX.Unlock()
+
+    acc_id, ok := AccountInts[account]
+    if !ok {
+        acc_id = len(AccountInts)
+        AccountInts[account] = acc_id
+    }
+    return acc_id
+}
+
 func load_auth() {
 
     file, err := ioutil.ReadFile(Options.AccountFilename)
@@ -1124,6 +3411,9 @@ func load_auth() {
         switch apikey.(type) {
             case string:
                 Auth[acc] = apikey.(string)
+                if apikey.(string) != "" {
+                    AuthAccounts[apikey.(string)] = append(AuthAccounts[apikey.(string)], acc)
+                }
         }
     }
 
@@ -0,0 +1,228 @@
+package main
+
+// Shared memory transport to the backend (Linux only, enabled with -shm).
+//
+// Instead of 3 OS pipes, the frontend creates a file in /dev/shm holding 3
+// single-producer / single-consumer byte rings and hands it to the backend
+// as fd 3. Each ring is wrapped up as an io.Reader or io.Writer, so the rest
+// of the frontend doesn't know or care which transport a book is using.
+//
+// See the comments in the C file for the layout, which must match this.
+
+import (
+    "errors"
+    "io"
+    "io/ioutil"
+    "os"
+    "os/exec"
+    "runtime"
+    "sync/atomic"
+    "syscall"
+    "time"
+    "unsafe"
+)
+
+const (
+    SHM_MAGIC = 0x64425253          // "dBRS"
+    SHM_RINGS = 3
+    SHM_RING_SIZE = 1 << 20         // Bytes of data per ring, must be a power of 2
+    SHM_SPIN = 4000
+
+    SHM_HEADER_LEN = 64
+    SHM_RING_HEADER_LEN = 256
+
+    SHM_COMMANDS = 0
+    SHM_REPLIES = 1
+    SHM_WEBSOCKET = 2
+)
+
+const (
+    FUTEX_WAIT = 0                  // Not the _PRIVATE versions, since the other side is another process
+    FUTEX_WAKE = 1
+)
+
+type ShmRing struct {
+    head                *uint64     // Total bytes ever written
+    tail                *uint64     // Total bytes ever read
+    data_seq            *uint32     // Futex word the reader sleeps on
+    reader_waiting      *uint32
+    space_seq           *uint32     // Futex word the writer sleeps on
+    writer_waiting      *uint32
+    data                []byte
+    dead                *int32      // Set (on our side only) once the backend process has exited
+}
+
+// Timeout for each futex sleep, so that we notice if the backend has died...
+
+var shm_futex_timeout = syscall.NsecToTimespec(int64(100 * time.Millisecond))
+
+func shm_start(exec_command * exec.Cmd) (PipesStruct, error) {
+
+    // Create the shared memory, then start the backend with it as fd 3.
+
+    file, err := ioutil.TempFile("/dev/shm", "disorderBook-")
+    if err != nil {
+        return PipesStruct{}, err
+    }
+    defer file.Close()                  // The child has its own copy of the fd by then, and the mapping survives
+    os.Remove(file.Name())              // Nobody else needs to find it by name
+
+    total_len := SHM_HEADER_LEN + SHM_RINGS * (SHM_RING_HEADER_LEN + SHM_RING_SIZE)
+
+    err = file.Truncate(int64(total_len))
+    if err != nil {
+        return PipesStruct{}, err
+    }
+
+    mem, err := syscall.Mmap(int(file.Fd()), 0, total_len, syscall.PROT_READ | syscall.PROT_WRITE, syscall.MAP_SHARED)
+    if err != nil {
+        return PipesStruct{}, err
+    }
+
+    *(*uint32)(unsafe.Pointer(&mem[0])) = SHM_MAGIC
+    *(*uint32)(unsafe.Pointer(&mem[4])) = SHM_RINGS
+    *(*uint64)(unsafe.Pointer(&mem[8])) = SHM_RING_SIZE
+
+    dead := new(int32)
+    var rings [SHM_RINGS]*ShmRing
+
+    for n := 0; n < SHM_RINGS; n++ {
+        base := SHM_HEADER_LEN + n * (SHM_RING_HEADER_LEN + SHM_RING_SIZE)
+        rings[n] = &ShmRing{
+            head:           (*uint64)(unsafe.Pointer(&mem[base])),
+            tail:           (*uint64)(unsafe.Pointer(&mem[base + 64])),
+            data_seq:       (*uint32)(unsafe.Pointer(&mem[base + 128])),
+            reader_waiting: (*uint32)(unsafe.Pointer(&mem[base + 132])),
+            space_seq:      (*uint32)(unsafe.Pointer(&mem[base + 192])),
+            writer_waiting: (*uint32)(unsafe.Pointer(&mem[base + 196])),
+            data:           mem[base + SHM_RING_HEADER_LEN : base + SHM_RING_HEADER_LEN + SHM_RING_SIZE],
+            dead:           dead,
+        }
+    }
+
+    exec_command.Args = append(exec_command.Args, "-shm")
+    exec_command.ExtraFiles = []*os.File{file}
+
+    err = exec_command.Start()
+    if err != nil {
+        syscall.Munmap(mem)
+        return PipesStruct{}, err
+    }
+
+    go func() {
+        exec_command.Wait()
+        atomic.StoreInt32(dead, 1)
+    }()
+
+    return PipesStruct{rings[SHM_COMMANDS], rings[SHM_REPLIES], rings[SHM_WEBSOCKET], exec_command.Process}, nil
+}
+
+func (r * ShmRing) sleep(seq * uint32, waiting * uint32, blocked_used uint64) {
+
+    // Wait while the ring holds exactly blocked_used bytes (0 for the reader,
+    // the ring size for the writer). Spin a bit first, then sleep on the futex.
+
+    for n := 0; n < SHM_SPIN; n++ {
+        if atomic.LoadUint64(r.head) - atomic.LoadUint64(r.tail) != blocked_used {
+            return
+        }
+        if n % 64 == 63 {
+            runtime.Gosched()
+        }
+    }
+
+    atomic.StoreUint32(waiting, 1)
+    seqval := atomic.LoadUint32(seq)
+
+    if atomic.LoadUint64(r.head) - atomic.LoadUint64(r.tail) == blocked_used {
+        syscall.Syscall6(syscall.SYS_FUTEX, uintptr(unsafe.Pointer(seq)), FUTEX_WAIT, uintptr(seqval),
+                         uintptr(unsafe.Pointer(&shm_futex_timeout)), 0, 0)
+    }
+
+    atomic.StoreUint32(waiting, 0)
+}
+
+func (r * ShmRing) wake(seq * uint32, waiting * uint32) {
+    if atomic.LoadUint32(waiting) != 0 {
+        atomic.AddUint32(seq, 1)
+        syscall.Syscall6(syscall.SYS_FUTEX, uintptr(unsafe.Pointer(seq)), FUTEX_WAKE, 1, 0, 0, 0)
+    }
+}
+
+func (r * ShmRing) Read(p []byte) (int, error) {
+
+    if len(p) == 0 {
+        return 0, nil
+    }
+
+    size := uint64(len(r.data))
+    tail := atomic.LoadUint64(r.tail)
+
+    head := atomic.LoadUint64(r.head)
+    for head == tail {
+        if atomic.LoadInt32(r.dead) != 0 {
+            return 0, io.EOF
+        }
+        r.sleep(r.data_seq, r.reader_waiting, 0)
+        head = atomic.LoadUint64(r.head)
+    }
+
+    offset := tail & (size - 1)
+
+    n := head - tail
+    if n > uint64(len(p)) {
+        n = uint64(len(p))
+    }
+    if n > size - offset {                  // Don't wrap; caller will come back for more
+        n = size - offset
+    }
+
+    copy(p, r.data[offset : offset + n])
+
+    atomic.StoreUint64(r.tail, tail + n)
+    r.wake(r.space_seq, r.writer_waiting)
+
+    return int(n), nil
+}
+
+func (r * ShmRing) Write(p []byte) (int, error) {
+
+    size := uint64(len(r.data))
+    head := atomic.LoadUint64(r.head)
+
+    done := 0
+
+    for done < len(p) {
+
+        for head - atomic.LoadUint64(r.tail) == size {
+            if atomic.LoadInt32(r.dead) != 0 {
+                return done, errors.New("backend has exited")
+            }
+            r.sleep(r.space_seq, r.writer_waiting, size)
+        }
+
+        offset := head & (size - 1)
+
+        n := size - (head - atomic.LoadUint64(r.tail))
+        if n > uint64(len(p) - done) {
+            n = uint64(len(p) - done)
+        }
+        if n > size - offset {
+            n = size - offset
+        }
+
+        copy(r.data[offset : offset + n], p[done : done + int(n)])
+
+        head += n
+        atomic.StoreUint64(r.head, head)
+        r.wake(r.data_seq, r.reader_waiting)
+
+        done += int(n)
+    }
+
+    return done, nil
+}
+
+func (r * ShmRing) Close() error {
+    return nil
+}
@@ -0,0 +1,15 @@
+//go:build !linux
+// +build !linux
+
+package main
+
+// The shared memory transport needs futexes, so elsewhere we always use pipes.
+
+import (
+    "errors"
+    "os/exec"
+)
+
+func shm_start(exec_command * exec.Cmd) (PipesStruct, error) {
+    return PipesStruct{}, errors.New("shared memory transport is only available on Linux")
+}